@@ -0,0 +1,127 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+#include "utils.h"
+
+/**
+ * @brief a pool of T in fixed-size chunks, addressed by generation-checked handles
+ *
+ * @details objects are constructed in place in chunks of ChunkSize slots, so neighbouring objects share
+ * cache lines and pages, and an object never moves: callbacks and coroutines may keep a pointer to it for
+ * as long as it lives. Freed slots are reused LIFO (the most recently freed one is the warmest).
+ *
+ * A Handle is the slot index plus the slot's generation, which is bumped on every erase; get() and erase()
+ * of a stale handle (its object was erased, the slot may hold a new one) return nullptr / false.
+ *
+ * @note not thread-safe, each event loop owns its own slab
+ */
+template<typename T, size_t ChunkSize = 256>
+class Slab : noncopyable {
+public:
+    struct Handle {
+        uint32_t index = 0;
+        uint32_t generation = 0; // 0 never names an object
+        bool valid() const { return generation != 0; }
+    };
+
+    Slab() = default;
+    ~Slab() { clear(); }
+
+    template<typename... Args>
+    std::pair<Handle, T*> emplace(Args&&... args) {
+        uint32_t index = freeHead_;
+        if (index == kNil) {
+            index = grow();
+        }
+        Slot& slot = slotAt(index);
+        // a throwing constructor leaves the slot on the free list
+        T* object = ::new (static_cast<void*>(slot.storage)) T(std::forward<Args>(args)...);
+        freeHead_ = slot.nextFree;
+        slot.alive = true;
+        size_++;
+        return {Handle{index, slot.generation}, object};
+    }
+
+    // nullptr when the handle is stale
+    T* get(Handle handle) {
+        if (handle.index >= capacity()) {
+            return nullptr;
+        }
+        Slot& slot = slotAt(handle.index);
+        if (!slot.alive || slot.generation != handle.generation) {
+            return nullptr;
+        }
+        return slot.object();
+    }
+
+    // destroys the object, false when the handle is stale
+    bool erase(Handle handle) {
+        if (!get(handle)) {
+            return false;
+        }
+        release(handle.index);
+        return true;
+    }
+
+    void clear() {
+        for (uint32_t index = 0; index < capacity(); index++) {
+            if (slotAt(index).alive) {
+                release(index);
+            }
+        }
+    }
+
+    size_t size() const { return size_; }
+    uint32_t capacity() const { return static_cast<uint32_t>(chunks_.size() * ChunkSize); }
+
+private:
+    static constexpr uint32_t kNil = UINT32_MAX;
+
+    struct Slot {
+        alignas(T) unsigned char storage[sizeof(T)];
+        uint32_t generation = 1;
+        uint32_t nextFree = kNil;
+        bool alive = false;
+
+        T* object() { return std::launder(reinterpret_cast<T*>(storage)); }
+    };
+
+    struct Chunk {
+        Slot slots[ChunkSize];
+    };
+
+    Slot& slotAt(uint32_t index) {
+        return chunks_[index / ChunkSize]->slots[index % ChunkSize];
+    }
+
+    // adds a chunk and threads its slots onto the free list, returns the first one
+    uint32_t grow() {
+        uint32_t base = capacity();
+        chunks_.push_back(std::make_unique<Chunk>());
+        Chunk& chunk = *chunks_.back();
+        for (size_t i = 0; i < ChunkSize; i++) {
+            chunk.slots[i].nextFree = i + 1 < ChunkSize ? base + static_cast<uint32_t>(i + 1) : freeHead_;
+        }
+        freeHead_ = base;
+        return base;
+    }
+
+    void release(uint32_t index) {
+        Slot& slot = slotAt(index);
+        // mark it dead first, the destructor may look itself up (e.g. a close callback)
+        slot.alive = false;
+        slot.generation = slot.generation == UINT32_MAX ? 1 : slot.generation + 1;
+        slot.object()->~T();
+        slot.nextFree = freeHead_;
+        freeHead_ = index;
+        size_--;
+    }
+
+    std::vector<std::unique_ptr<Chunk>> chunks_;
+    uint32_t freeHead_ = kNil;
+    size_t size_ = 0;
+};
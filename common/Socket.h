@@ -3,6 +3,7 @@
 #include <string>
 #include <system_error>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -45,12 +46,26 @@ private:
 class Socket : public noncopyable {
 
 public:
-    Socket(const std::string& ip_port) : serverAddr(ip_port){
+    /**
+     * @param reusePort set SO_REUSEADDR | SO_REUSEPORT before bind, so several sockets
+     * (e.g. one per thread) can listen on the same port and the kernel spreads the connections among them
+     */
+    Socket(const std::string& ip_port, bool reusePort = false) : serverAddr(ip_port){
         fd = socket(AF_INET, SOCK_STREAM, 0);
         if (fd < 0) {
             throw std::system_error(errno, std::system_category(), "socket");
         }
 
+        if (reusePort) {
+            setReusePort();
+        } else {
+            // the server closes idle connections itself, their TIME_WAIT must not block a restart
+            int opt = 1;
+            if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+                throw std::system_error(errno, std::system_category(), "setsockopt SO_REUSEADDR");
+            }
+        }
+
         if (bind(fd, (sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
             throw std::system_error(errno, std::system_category(), "bind");
         }
@@ -60,10 +75,15 @@ public:
         close(fd);
     }
 
+    // NOTE: SO_REUSEPORT only shares the port if it is set before bind
     void setReusePort(){
         int opt = 1;
-        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
-            throw std::system_error(errno, std::system_category(), "setsockopt");
+        // the options are not bit flags, each needs its own setsockopt
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+            throw std::system_error(errno, std::system_category(), "setsockopt SO_REUSEADDR");
+        }
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+            throw std::system_error(errno, std::system_category(), "setsockopt SO_REUSEPORT");
         }
     }
 
@@ -83,13 +103,22 @@ public:
         }
     }
 
-    int accept(InetAddr* clientAddr){
-        socklen_t len = clientAddr->get_size();
-        int connfd = ::accept(fd, (sockaddr*)clientAddr->getAddr(), &len);
-        if (connfd < 0) {
-            throw std::system_error(errno, std::system_category(), "accept");
+    // TCP_DEFER_ACCEPT: a connection only becomes acceptable once its first data arrived (or after about
+    // seconds, when the kernel gives up waiting), so the server never wakes up for a connection with nothing to read
+    void setDeferAccept(int seconds) {
+        if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds)) < 0) {
+            throw std::system_error(errno, std::system_category(), "setsockopt TCP_DEFER_ACCEPT");
         }
-        return connfd;
+    }
+
+    /**
+     * @param flags accept4 flags, e.g. SOCK_NONBLOCK | SOCK_CLOEXEC, saving the fcntl calls on the new socket
+     * @return the connected fd, or -1 with errno set. No exception: on a non-blocking listener failing is
+     * part of the normal operation (EAGAIN once the queue is empty, EMFILE under load, ECONNABORTED ...)
+     */
+    int accept(InetAddr* clientAddr, int flags = 0){
+        socklen_t len = clientAddr->get_size();
+        return ::accept4(fd, (sockaddr*)clientAddr->getAddr(), &len, flags);
     }
 
     int getFd(){
@@ -0,0 +1,309 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <utility>
+#include "utils.h"
+
+/**
+ * @brief hierarchical timing wheel, O(1) to add and to cancel a timer
+ *
+ * @details time is counted in ticks (1ms by default). Level 0 has 256 slots of one tick, levels 1-3
+ * have 64 slots each, covering 2^14, 2^20 and 2^26 ticks (about 18 hours at 1ms); a timer further
+ * out waits in the last level and is placed again when it comes close. A timer goes into the
+ * slot of the lowest level that covers its distance, and each time level 0 wraps around, the next slot
+ * of the level above is emptied into the levels below (cascade). So advancing costs O(1) per tick plus
+ * O(1) per timer per level, independent of the number of timers - no heap.
+ *
+ * Timers live in a stable deque, linked into their slot by index, and are reused through a free list;
+ * a TimerId carries a generation, so cancelling a timer that already fired (or whose node was reused)
+ * does nothing.
+ *
+ * Not thread-safe: the owning event loop adds, cancels and advances it.
+ */
+class TimerWheel : noncopyable {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Callback = std::function<void()>;
+
+    struct TimerId {
+        uint32_t index = 0;
+        uint32_t generation = 0; // 0 never names a timer
+        bool valid() const { return generation != 0; }
+    };
+
+    explicit TimerWheel(std::chrono::milliseconds tick = std::chrono::milliseconds(1), Clock::time_point start = Clock::now())
+        : tick_(tick), start_(start) {
+        level0_.fill(kNil);
+        for (auto& level : levels_) {
+            level.fill(kNil);
+        }
+    }
+
+    // run cb once, delay from now (at least one tick)
+    TimerId runAfter(std::chrono::milliseconds delay, Callback cb) {
+        return add(delay, std::chrono::milliseconds(0), std::move(cb));
+    }
+
+    // run cb every interval, the first time after one interval
+    TimerId runEvery(std::chrono::milliseconds interval, Callback cb) {
+        return add(interval, interval, std::move(cb));
+    }
+
+    // returns false if the timer already fired (one-shot) or was cancelled
+    bool cancel(TimerId id) {
+        if (!id.valid() || id.index >= nodes_.size()) {
+            return false;
+        }
+        Node& node = nodes_[id.index];
+        if (node.generation != id.generation) {
+            return false;
+        }
+        if (node.linked) {
+            unlink(id.index);
+        }
+        // a timer cancelled from its own callback is released once the callback returns
+        if (!node.firing) {
+            release(id.index);
+        } else {
+            node.generation = nextGeneration(node.generation);
+        }
+        return true;
+    }
+
+    /**
+     * @brief run every timer that is due at now
+     *
+     * @note callbacks may add and cancel timers, including themselves
+     */
+    void advance(Clock::time_point now) {
+        uint64_t target = tickOf(now);
+        while (current_ < target) {
+            if (active_ == 0) {
+                // nothing to run or cascade, jump
+                current_ = target;
+                break;
+            }
+            current_++;
+            if ((current_ & kLevel0Mask) == 0) {
+                cascade();
+            }
+            expire(level0_[current_ & kLevel0Mask]);
+        }
+    }
+
+    /**
+     * @brief when the owner has to call advance() again
+     *
+     * @details the start of the next non-empty level 0 slot, or of the next cascade when level 0 is empty.
+     * advance() at this time point (or later) finds the slot due, so an owner that arms its timer with it
+     * never wakes up early. Only meaningful while size() > 0.
+     */
+    Clock::time_point nextDueTime() const {
+        uint64_t wrap = (current_ | kLevel0Mask) + 1;
+        uint64_t due = wrap;
+        for (uint64_t t = current_ + 1; t < wrap; t++) {
+            if (level0_[t & kLevel0Mask] != kNil) {
+                due = t;
+                break;
+            }
+        }
+        return start_ + tick_ * static_cast<int64_t>(due);
+    }
+
+    /**
+     * @brief how long the owner may sleep before calling advance() again
+     *
+     * @return -1 when there is no timer, otherwise the time until nextDueTime(), rounded up
+     */
+    int64_t nextTimeoutMs(Clock::time_point now) const {
+        if (active_ == 0) {
+            return -1;
+        }
+        // NOTE: rounded up, a truncated timeout would wake up before the slot is due and find nothing to do
+        auto left = std::chrono::ceil<std::chrono::milliseconds>(nextDueTime() - now).count();
+        return left > 0 ? left : 0;
+    }
+
+    size_t size() const { return active_; }
+    std::chrono::milliseconds tick() const { return tick_; }
+
+private:
+    static constexpr uint32_t kNil = UINT32_MAX;
+    static constexpr int kLevel0Bits = 8;
+    static constexpr int kLevelBits = 6;
+    static constexpr int kLevels = 3;
+    static constexpr uint64_t kLevel0Mask = (1u << kLevel0Bits) - 1;
+    static constexpr uint64_t kLevelMask = (1u << kLevelBits) - 1;
+    static constexpr uint64_t kMaxDistance = uint64_t(1) << (kLevel0Bits + kLevelBits * kLevels);
+
+    struct Node {
+        Callback callback;
+        uint64_t expiry = 0;   // tick
+        uint64_t interval = 0; // ticks, 0 for one-shot
+        uint32_t prev = kNil;
+        uint32_t next = kNil;
+        uint32_t* slot = nullptr;
+        uint32_t generation = 1;
+        bool linked = false;
+        bool firing = false;
+    };
+
+    static uint32_t nextGeneration(uint32_t generation) {
+        return generation == UINT32_MAX ? 1 : generation + 1;
+    }
+
+    uint64_t tickOf(Clock::time_point time) const {
+        if (time <= start_) {
+            return 0;
+        }
+        return static_cast<uint64_t>((time - start_) / tick_);
+    }
+
+    uint64_t ceilTickOf(Clock::time_point time) const {
+        if (time <= start_) {
+            return 0;
+        }
+        return static_cast<uint64_t>((time - start_ + tick_ - Clock::duration(1)) / tick_);
+    }
+
+    uint64_t ticksOf(std::chrono::milliseconds duration) const {
+        uint64_t ticks = static_cast<uint64_t>((duration + tick_ - std::chrono::milliseconds(1)) / tick_);
+        return ticks == 0 ? 1 : ticks;
+    }
+
+    TimerId add(std::chrono::milliseconds delay, std::chrono::milliseconds interval, Callback cb) {
+        uint32_t index;
+        if (freeList_ != kNil) {
+            index = freeList_;
+            freeList_ = nodes_[index].next;
+        } else {
+            index = static_cast<uint32_t>(nodes_.size());
+            nodes_.emplace_back();
+        }
+        Node& node = nodes_[index];
+        node.callback = std::move(cb);
+        // the first tick boundary at or after now + delay (never early), relative to the real time since
+        // the wheel may lag behind it until the next advance()
+        node.expiry = std::max(current_ + 1, ceilTickOf(Clock::now() + delay));
+        node.interval = interval.count() > 0 ? ticksOf(interval) : 0;
+        node.firing = false;
+        insert(index);
+        active_++;
+        return TimerId{index, node.generation};
+    }
+
+    void release(uint32_t index) {
+        Node& node = nodes_[index];
+        node.callback = nullptr;
+        node.generation = nextGeneration(node.generation);
+        node.firing = false;
+        node.next = freeList_;
+        freeList_ = index;
+        active_--;
+    }
+
+    uint32_t* slotFor(uint64_t expiry) {
+        uint64_t distance = expiry > current_ ? expiry - current_ : 0;
+        if (distance < (uint64_t(1) << kLevel0Bits)) {
+            return &level0_[expiry & kLevel0Mask];
+        }
+        if (distance >= kMaxDistance) {
+            // out of range, park it in the farthest slot and place it again when it cascades
+            expiry = current_ + kMaxDistance - 1;
+        }
+        for (int level = 0; level < kLevels; level++) {
+            int shift = kLevel0Bits + kLevelBits * level;
+            if (distance < (uint64_t(1) << (shift + kLevelBits)) || level == kLevels - 1) {
+                return &levels_[level][(expiry >> shift) & kLevelMask];
+            }
+        }
+        return nullptr;
+    }
+
+    void insert(uint32_t index) {
+        Node& node = nodes_[index];
+        uint32_t* slot = slotFor(node.expiry);
+        node.slot = slot;
+        node.prev = kNil;
+        node.next = *slot;
+        if (*slot != kNil) {
+            nodes_[*slot].prev = index;
+        }
+        *slot = index;
+        node.linked = true;
+    }
+
+    void unlink(uint32_t index) {
+        Node& node = nodes_[index];
+        if (node.prev != kNil) {
+            nodes_[node.prev].next = node.next;
+        } else {
+            *node.slot = node.next;
+        }
+        if (node.next != kNil) {
+            nodes_[node.next].prev = node.prev;
+        }
+        node.prev = node.next = kNil;
+        node.slot = nullptr;
+        node.linked = false;
+    }
+
+    // empty the next slot of each level above whose lower level just wrapped around
+    void cascade() {
+        for (int level = 0; level < kLevels; level++) {
+            int shift = kLevel0Bits + kLevelBits * level;
+            uint32_t& slot = levels_[level][(current_ >> shift) & kLevelMask];
+            while (slot != kNil) {
+                uint32_t index = slot;
+                unlink(index);
+                insert(index);
+            }
+            // the level above only moves when this one wrapped too
+            if (((current_ >> shift) & kLevelMask) != 0) {
+                break;
+            }
+        }
+    }
+
+    void expire(uint32_t& slot) {
+        while (slot != kNil) {
+            uint32_t index = slot;
+            unlink(index);
+            Node& node = nodes_[index];
+            if (node.expiry > current_) {
+                // parked out of range
+                insert(index);
+                continue;
+            }
+            uint32_t generation = node.generation;
+            node.firing = true;
+            // nodes_ is a deque, the reference stays valid while the callback adds timers
+            node.callback();
+            node.firing = false;
+            if (node.generation != generation) {
+                // cancelled from inside its callback
+                node.generation = generation;
+                release(index);
+            } else if (node.interval) {
+                node.expiry = current_ + node.interval;
+                insert(index);
+            } else {
+                release(index);
+            }
+        }
+    }
+
+    std::chrono::milliseconds tick_;
+    Clock::time_point start_;
+    uint64_t current_ = 0;
+    size_t active_ = 0;
+    std::array<uint32_t, 1u << kLevel0Bits> level0_;
+    std::array<std::array<uint32_t, 1u << kLevelBits>, kLevels> levels_;
+    std::deque<Node> nodes_;
+    uint32_t freeList_ = kNil;
+};
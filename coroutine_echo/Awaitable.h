@@ -1,14 +1,41 @@
 #pragma once
+#include <cerrno>
+#include <chrono>
 #include <coroutine>
+#include <type_traits>
+#include <utility>
 #include <liburing.h>
 #include <liburing/io_uring.h>
-#include <any>
+#include "Cancellation.h"
 #include "IoUringScheduler.h"
 #include "IoUringSchedulerAdapter.h"
 
 // NOTE: Attr, Awaitable and awaitable_traits used to foward the parameters to the io_uring functions
 struct Attr{
     io_uring_sqe* sqe;
+    // a deadline: when non-zero the sqe is linked to an IORING_OP_LINK_TIMEOUT, and the operation
+    // completes with -ECANCELED if it has not finished in time
+    std::chrono::nanoseconds timeout{0};
+};
+
+/**
+ * @brief the fd an operation works on: a plain fd, or an index into the ring's registered (fixed) file table
+ *
+ * @note fixed files skip the fget/fput the kernel does on every operation, but they only exist inside the ring,
+ * so they must be closed with io_uring_prep_close_direct and can't be used with plain syscalls.
+ */
+struct IoFd{
+    IoFd(int fd = -1, bool fixed = false) : fd(fd), fixed(fixed) {}
+
+    // call after io_uring_prep_*, which resets sqe->flags
+    void apply(io_uring_sqe* sqe) const {
+        if (fixed) {
+            sqe->flags |= IOSQE_FIXED_FILE;
+        }
+    }
+
+    int fd;
+    bool fixed;
 };
 
 class Awaitable{
@@ -20,23 +47,135 @@ class Awaitable{
  * @details Now, the event-loop is implemented by the io_uring, we can use co_await xxxAttr to prepare the sqe
  * it will automatically transform into an SubmitAwaitable, which will warp the current coroutine into the sqe->user_data
  * This class controls the lifetime of the coroutine have co_await Attr.
+ *
+ * @note the operation honours the CancellationToken of the awaiting coroutine (promise_base::cancellation) and
+ * the deadline of its Attr.
  */
 class SubmitAwaitable : public Awaitable{
 public:
     bool await_ready() noexcept { return false; }
-    void await_suspend(std::coroutine_handle<> handle){
-        sqe->user_data = getScheduler().getNewId();
-        getScheduler().handles[sqe->user_data] = handle;
+    bool await_suspend(std::coroutine_handle<> handle){
+        this->handle = handle;
+        token = promiseOf(handle).cancellation;
+        if (token && token->isCancelled()) {
+            // the sqe is already prepared and will be submitted, turn it into a NOP nobody waits for
+            io_uring_prep_nop(sqe);
+            sqe->user_data = user_data::kNone;
+            *res = -ECANCELED;
+            token = nullptr;
+            return false;
+        }
+        // the completion resumes the frame stored in user_data directly, see user_data:: in IoUringScheduler.h
+        sqe->user_data = user_data::fromCoroutine(handle);
+        if (timeout.count() > 0 && !linkTimeout()) {
+            // the ring does not take requests any more, the operation was turned into a NOP
+            *res = -EBUSY;
+            token = nullptr;
+            return false;
+        }
+        if (token) {
+            token->track(sqe->user_data);
+        }
+        return true;
     }
     int await_resume(){
+        if (token) {
+            token->untrack(user_data::fromCoroutine(handle));
+        }
         return *res;
     }
 protected:
     SubmitAwaitable(io_uring_sqe* sqe, int* res) : sqe(sqe), res(res){}
+    SubmitAwaitable(const Attr& attr, int* res) : sqe(attr.sqe), res(res), timeout(attr.timeout){}
+
+    // cqe->flags of the completion, only valid in await_resume
+    uint32_t cqeFlags() const {
+        return promiseOf(handle).cqe_flags;
+    }
+
     io_uring_sqe* sqe;
     int* res;
+    std::coroutine_handle<> handle = nullptr;
+
+private:
+    static promise_base& promiseOf(std::coroutine_handle<> handle) {
+        return std::coroutine_handle<promise_base>::from_address(handle.address()).promise();
+    }
+
+    // the LINK_TIMEOUT must directly follow the sqe, nothing else takes an sqe in between
+    bool linkTimeout() {
+        IoUringScheduler& scheduler = getScheduler();
+        io_uring_sqe* timeoutSqe = io_uring_get_sqe(scheduler.getRing());
+        if (!timeoutSqe) {
+            // SQ full: submitting now would send the operation off without its deadline; move it to a fresh pair
+            // of sqes and leave a NOP nobody waits for in its old place
+            io_uring_sqe op = *sqe;
+            io_uring_prep_nop(sqe);
+            sqe->user_data = user_data::kNone;
+            if (!scheduler.reserveSqes(2)) {
+                return false;
+            }
+            sqe = io_uring_get_sqe(scheduler.getRing());
+            *sqe = op;
+            timeoutSqe = io_uring_get_sqe(scheduler.getRing());
+        }
+        auto seconds = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+        ts.tv_sec = seconds.count();
+        ts.tv_nsec = (timeout - seconds).count();
+        sqe->flags |= IOSQE_IO_LINK;
+        // NOTE: the kernel reads ts when it picks up the sqe (maybe later, in the SQPOLL thread), so it lives here
+        io_uring_prep_link_timeout(timeoutSqe, &ts, 0);
+        timeoutSqe->user_data = user_data::kNone;
+        return true;
+    }
+
+    std::chrono::nanoseconds timeout{0};
+    __kernel_timespec ts{};
+    CancellationToken* token = nullptr;
+};
+
+/**
+ * @brief the synchronous fast path of an operation: run a non-blocking syscall right away, without suspending
+ *
+ * @details op is a call like ::recv(fd, buf, len, MSG_DONTWAIT) returning a byte count or -1 with errno set.
+ * co_await returns its result, or -errno; -EAGAIN means it would have blocked, or the scheduler did not allow
+ * a fast path this time (IoUringScheduler::takeInlineBudget), and the caller submits the operation to the ring.
+ * Nothing is submitted here, so the caller takes the sqe only after the fast path failed.
+ *
+ * @note like SubmitAwaitable it honours the CancellationToken of the awaiting coroutine: a cancelled one
+ * gets -ECANCELED without the syscall.
+ */
+template<typename Op>
+class InlineIoAwaitable : public Awaitable{
+public:
+    explicit InlineIoAwaitable(Op op) : op(std::move(op)) {}
+    bool await_ready() noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> handle){
+        auto* token = std::coroutine_handle<promise_base>::from_address(handle.address()).promise().cancellation;
+        if (token && token->isCancelled()) {
+            res = -ECANCELED;
+        } else if (!getScheduler().takeInlineBudget()) {
+            res = -EAGAIN;
+        } else {
+            auto n = op();
+            res = n >= 0 ? static_cast<int>(n) : (errno == EWOULDBLOCK ? -EAGAIN : -errno);
+        }
+        return false;
+    }
+    int await_resume(){
+        return res;
+    }
+private:
+    Op op;
+    int res = -EAGAIN;
 };
 
+// co_await tryInline([&] { return ::send(fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL); })
+template<typename Op>
+InlineIoAwaitable<std::decay_t<Op>> tryInline(Op&& op) {
+    return InlineIoAwaitable<std::decay_t<Op>>(std::forward<Op>(op));
+}
+
 template<typename TaskType>
 class TaskAwaitable : public Awaitable{
 public:
@@ -45,17 +184,25 @@ public:
     bool await_ready() noexcept {
         return task.coro.done();
     }
-    void await_suspend(std::coroutine_handle<> awaiting) noexcept {
-        task.coro.promise().caller = awaiting;
-        task.coro.resume();
+    // symmetric transfer: the task runs in place of the awaiting coroutine instead of on top of it, and its
+    // final_awaiter transfers back the same way, so a deep chain of tasks that complete inline keeps the stack flat
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        auto& promise = task.coro.promise();
+        promise.caller = awaiting;
+        // the awaited task runs under the caller's cancellation token unless it has its own
+        if (!promise.cancellation) {
+            promise.cancellation = std::coroutine_handle<promise_base>::from_address(awaiting.address())
+                                       .promise().cancellation;
+        }
+        return task.coro;
     }
     TaskType::return_type await_resume() {
         if constexpr(std::is_same_v<typename TaskType::return_type, void>){
             return;
         }
         else{
-            auto promise = static_cast<TaskType::promise_type&>(task.coro.promise());
-            return std::any_cast<typename TaskType::return_type>(promise.data);
+            auto& promise = static_cast<TaskType::promise_type&>(task.coro.promise());
+            return promise.take_value();
         }
     }
 private:
@@ -64,12 +211,13 @@ private:
     TaskType& task;
 };
 
+// co_await CoroAwaitable{} returns the handle of the awaiting coroutine itself, without suspending it
 class CoroAwaitable : public Awaitable{
 public:
     bool await_ready() noexcept { return false; }
-    void await_suspend(std::coroutine_handle<> handle){
+    bool await_suspend(std::coroutine_handle<> handle){
         coro = handle;
-        handle.resume();
+        return false;
     }
     std::coroutine_handle<> await_resume(){
         return coro;
@@ -78,13 +226,16 @@ private:
     std::coroutine_handle<> coro;
 };
 
+/**
+ * @brief suspend unconditionally, without arranging anything for the resumption
+ *
+ * @note whoever uses it must have handed the handle to someone who resumes or destroys it,
+ * e.g. when_any sets itself as the caller of its branches before it suspends.
+ */
 class ForgetAwaitable : public Awaitable{
 public:
     bool await_ready() noexcept { return false; }
-    void await_suspend(std::coroutine_handle<> handle){
-        // HACK: just forget the coroutine
-        // FIXME: should be destroy the coroutine somehow
-    }
+    void await_suspend(std::coroutine_handle<> handle){}
     void await_resume(){}
 };
 
@@ -104,4 +255,9 @@ struct awaitable_traits<CoroAwaitable>{
 template<>
 struct awaitable_traits<ForgetAwaitable>{
     using type = typename ::DoAsOriginal;
+};
+
+template<typename Op>
+struct awaitable_traits<InlineIoAwaitable<Op>>{
+    using type = typename ::DoAsOriginal;
 };
\ No newline at end of file
@@ -1,32 +1,62 @@
 #pragma once
+#include <chrono>
+#include <sys/socket.h>
 #include "Buffer.h"
+#include "BufferRing.h"
 #include "Task.h"
 #include "Awaitable.h"
 #include "IoUringSchedulerAdapter.h"
+#include "MultishotStream.h"
 
 struct RecvAttr : Attr{
-    int fd;
+    IoFd fd;
     struct iovec* buf;
     size_t size;
 };
 
+// recv into a buffer the kernel selects from a provided buffer group
+struct SelectRecvAttr : Attr{
+    IoFd fd;
+    uint16_t groupId;
+    size_t size;
+    uint32_t* flags; // out: cqe->flags, carries the selected buffer id
+};
+
 struct WriteAttr : Attr{
-    int fd;
+    IoFd fd;
     const char* buf;
     size_t size;
 };
 
 class RecvAwaitable : public SubmitAwaitable{
 public:
-    RecvAwaitable(RecvAttr attr, int* res) : SubmitAwaitable{attr.sqe, res}{
-        io_uring_prep_readv(attr.sqe, attr.fd, attr.buf, 2, 0);
+    RecvAwaitable(RecvAttr attr, int* res) : SubmitAwaitable{attr, res}{
+        io_uring_prep_readv(attr.sqe, attr.fd.fd, attr.buf, attr.size, 0);
+        attr.fd.apply(attr.sqe);
+    }
+};
+
+class SelectRecvAwaitable : public SubmitAwaitable{
+public:
+    SelectRecvAwaitable(SelectRecvAttr attr, int* res) : SubmitAwaitable{attr, res}, flags(attr.flags){
+        io_uring_prep_recv(attr.sqe, attr.fd.fd, nullptr, attr.size, 0);
+        attr.fd.apply(attr.sqe);
+        attr.sqe->flags |= IOSQE_BUFFER_SELECT;
+        attr.sqe->buf_group = attr.groupId;
+    }
+    int await_resume(){
+        *flags = cqeFlags();
+        return SubmitAwaitable::await_resume();
     }
+private:
+    uint32_t* flags;
 };
 
 class WriteAwaitable : public SubmitAwaitable{
 public:
-    WriteAwaitable(WriteAttr attr, int* res) : SubmitAwaitable{attr.sqe, res}{
-        io_uring_prep_send(attr.sqe, attr.fd, attr.buf, attr.size, 0);
+    WriteAwaitable(WriteAttr attr, int* res) : SubmitAwaitable{attr, res}{
+        io_uring_prep_send(attr.sqe, attr.fd.fd, attr.buf, attr.size, 0);
+        attr.fd.apply(attr.sqe);
     }
 };
 
@@ -35,48 +65,121 @@ struct awaitable_traits<RecvAttr>{
     using type = RecvAwaitable;
 };
 
+template<>
+struct awaitable_traits<SelectRecvAttr>{
+    using type = SelectRecvAwaitable;
+};
+
 template<>
 struct awaitable_traits<WriteAttr>{
     using type = WriteAwaitable;
 };
 
 
-Task<int> recv(Buffer& buffer, int fd) {
-    char extraBuf[65536];
-
-    io_uring_sqe *sqe = io_uring_get_sqe(getScheduler().getRing());
-    struct iovec vec[2];
-    vec[0].iov_base = buffer.begin() + buffer.writerIndex;
-    vec[0].iov_len = buffer.writableBytes();
-    vec[1].iov_base = extraBuf;
-    vec[1].iov_len = sizeof(extraBuf);
+// the least writable space recv(Buffer&) reads into
+constexpr size_t kMinRecvSpace = 4096;
 
-    int res = co_await RecvAttr{{sqe}, fd, vec, 2};
+/**
+ * @brief recv into count iovecs (readv), e.g. the two free segments of a ring buffer
+ *
+ * @return the number of bytes read, 0 on EOF, -ECANCELED when the timeout (if any) expired, -1 on other errors
+ *
+ * @note with the scheduler's inline I/O on, data that is already queued on the socket is read right away
+ * (recvmsg with MSG_DONTWAIT) and the coroutine does not suspend; only an empty socket goes through the ring.
+ * The iovecs must stay valid until the co_await returns.
+ */
+inline Task<int> recv(struct iovec* vec, size_t count, IoFd fd, std::chrono::nanoseconds timeout = {}) {
+    int res = -EAGAIN;
+    if (!fd.fixed) {
+        res = co_await tryInline([&] {
+            msghdr msg{};
+            msg.msg_iov = vec;
+            msg.msg_iovlen = count;
+            return ::recvmsg(fd.fd, &msg, MSG_DONTWAIT);
+        });
+    }
+    if (res == -EAGAIN) {
+        io_uring_sqe *sqe = getScheduler().getSqe();
+        res = co_await RecvAttr{{sqe, timeout}, fd, vec, count};
+    }
     if (res == 0) {
         co_return 0;
+    } else if (res == -ECANCELED) {
+        // deadline or cancellation
+        co_return res;
     } else if (res < 0) {
         std::cout << "ERROR: " << strerror(-res) << std::endl;
         co_return -1;
-    } else if (res <= buffer.writableBytes()) {
+    }
+    co_return res;
+}
+
+/**
+ * @brief recv straight into the writable space of the Buffer
+ *
+ * @return see recv(iovec*, ...)
+ *
+ * @note there is no stack spill buffer any more, a 64KB array in a coroutine makes every frame 64KB on the heap,
+ * so the Buffer grows to kMinRecvSpace before the read instead.
+ */
+Task<int> recv(Buffer& buffer, IoFd fd, std::chrono::nanoseconds timeout = {}) {
+    if (buffer.writableBytes() < kMinRecvSpace) {
+        buffer.makeSpace(kMinRecvSpace);
+    }
+
+    struct iovec vec[1];
+    vec[0].iov_base = buffer.begin() + buffer.writerIndex;
+    vec[0].iov_len = buffer.writableBytes();
+    Task<int> recvTask = recv(vec, 1, fd, timeout);
+    int res = co_await recvTask;
+    if (res > 0) {
         buffer.writerIndex += res;
-    } else {
-        size_t writable = buffer.writableBytes();
-        buffer.writerIndex = buffer.size();
-        buffer.append(extraBuf, res - writable);
     }
     co_return res;
 }
 
-Task<int> send(Buffer& buffer, int fd, size_t len) {
+/**
+ * @brief recv into a buffer selected from the scheduler's provided buffer ring
+ *
+ * @return the number of bytes in out, 0 on EOF, or -errno; -ENOBUFS means the ring ran dry
+ * (or is not supported), the caller is expected to fall back to recv(Buffer&)
+ * @param timeout 0 for none, otherwise the recv fails with -ECANCELED when nothing arrived in time
+ */
+Task<int> recv(ProvidedBuffer& out, IoFd fd, std::chrono::nanoseconds timeout = {}) {
+    auto* bufferRing = getScheduler().bufferRing();
+    if (!bufferRing) {
+        co_return -ENOBUFS;
+    }
+
+    io_uring_sqe *sqe = getScheduler().getSqe();
+    uint32_t flags = 0;
+    int res = co_await SelectRecvAttr{{sqe, timeout}, fd, bufferRing->groupId(), bufferRing->bufferSize(), &flags};
+    if (flags & IORING_CQE_F_BUFFER) {
+        out = bufferRing->take(flags, res > 0 ? res : 0);
+    }
+    if (res < 0 && res != -ENOBUFS && res != -ECANCELED) {
+        std::cout << "ERROR: " << strerror(-res) << std::endl;
+    }
+    co_return res;
+}
+
+// with inline I/O on, a send that fits into the socket buffer completes without suspending, see recv(Buffer&)
+inline Task<int> send(Buffer& buffer, IoFd fd, size_t len) {
     while (len > 0) {
         if (buffer.readableBytes() < len) {
             std::cout << "ERROR: Not enough data to send" << std::endl;
             co_return -1;
         }
-        io_uring_sqe *sqe = io_uring_get_sqe(getScheduler().getRing());
         char* buf = buffer.begin() + buffer.readerIndex;
 
-        int res = co_await WriteAttr{{sqe}, fd, buf, len};
+        int res = -EAGAIN;
+        if (!fd.fixed) {
+            res = co_await tryInline([&] { return ::send(fd.fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL); });
+        }
+        if (res == -EAGAIN) {
+            io_uring_sqe *sqe = getScheduler().getSqe();
+            res = co_await WriteAttr{{sqe}, fd, buf, len};
+        }
         if (res < 0) {
             std::cout << "ERROR: " << strerror(-res) << std::endl;
             co_return -1;
@@ -85,4 +188,100 @@ Task<int> send(Buffer& buffer, int fd, size_t len) {
         len -= res;
     }
     co_return len;
-} 
\ No newline at end of file
+}
+
+inline Task<int> send(const char* buf, IoFd fd, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        int res = -EAGAIN;
+        if (!fd.fixed) {
+            res = co_await tryInline([&] { return ::send(fd.fd, buf + sent, len - sent, MSG_DONTWAIT | MSG_NOSIGNAL); });
+        }
+        if (res == -EAGAIN) {
+            io_uring_sqe *sqe = getScheduler().getSqe();
+            res = co_await WriteAttr{{sqe}, fd, buf + sent, len - sent};
+        }
+        if (res < 0) {
+            std::cout << "ERROR: " << strerror(-res) << std::endl;
+            co_return -1;
+        }
+        sent += res;
+    }
+    co_return sent;
+} 
+
+// one cqe of a RecvStream: res is the byte count, 0 on EOF or -errno; buffer holds the bytes when res > 0
+struct RecvChunk {
+    int res;
+    ProvidedBuffer buffer;
+};
+
+/**
+ * @brief a multishot recv (IORING_RECV_MULTISHOT) on one connection, every cqe fills a provided buffer
+ *
+ * @details the sqe stays armed across messages, so a handler just co_await next() for the next chunk
+ * without submitting anything. When the buffer ring runs dry the kernel ends the request with -ENOBUFS,
+ * the chunk is handed out as is, and the next call to next() re-arms it.
+ *
+ * The kernel keeps receiving while the handler is busy (e.g. echoing to a peer that does not read), so
+ * the queued bytes are bounded by watermarks: at highWatermark the stream pauses, and it is re-armed when
+ * the handler has taken all but lowWatermark of them. A slow peer thus holds at most about highWatermark of
+ * the provided buffers, which all connections of the ring share.
+ */
+class RecvStream : public MultishotStream<RecvChunk> {
+public:
+    static constexpr size_t kDefaultHighWatermark = 256 * 1024;
+    static constexpr size_t kDefaultLowWatermark = 64 * 1024;
+
+    RecvStream(IoUringScheduler* scheduler, IoFd fd, size_t highWatermark = kDefaultHighWatermark,
+               size_t lowWatermark = kDefaultLowWatermark)
+        : MultishotStream<RecvChunk>(scheduler), fd_(fd), bufferRing_(scheduler->bufferRing()),
+          highWatermark_(highWatermark), lowWatermark_(lowWatermark < highWatermark ? lowWatermark : highWatermark) {}
+
+    // bytes received and not yet taken by next()
+    size_t queuedBytes() const { return queuedBytes_; }
+
+protected:
+    void prepare(io_uring_sqe* sqe) override {
+        io_uring_prep_recv_multishot(sqe, fd_.fd, nullptr, 0, 0);
+        fd_.apply(sqe);
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = bufferRing_->groupId();
+    }
+
+    void deliver(int res, uint32_t flags) override {
+        RecvChunk chunk{res, {}};
+        if (flags & IORING_CQE_F_BUFFER) {
+            chunk.buffer = bufferRing_->take(flags, res > 0 ? res : 0);
+        }
+        if (res > 0) {
+            queuedBytes_ += res;
+        }
+        push(std::move(chunk));
+        if (queuedBytes_ >= highWatermark_) {
+            pause();
+        }
+    }
+
+    bool canRearm() const override {
+        if (ready_.empty()) {
+            return true;
+        }
+        // NOTE: never while an EOF or error is queued, the handler may answer it with a single-shot recv,
+        // and two recvs on one socket could reorder the data
+        return queuedBytes_ <= lowWatermark_ && ready_.back().res > 0;
+    }
+
+    void taken(const RecvChunk& chunk) override {
+        if (chunk.res > 0) {
+            queuedBytes_ -= chunk.res;
+        }
+    }
+
+private:
+    IoFd fd_;
+    ProvidedBufferRing* bufferRing_;
+    size_t highWatermark_;
+    size_t lowWatermark_;
+    size_t queuedBytes_ = 0;
+};
@@ -0,0 +1,184 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <liburing.h>
+#include <liburing/io_uring.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <system_error>
+#include <utility>
+#include "utils.h"
+
+class ProvidedBufferRing;
+
+/**
+ * @brief a buffer picked by the kernel from a ProvidedBufferRing (IOSQE_BUFFER_SELECT)
+ *
+ * @details it owns the buffer id until release() or destruction, then the buffer goes back to the ring,
+ * so the memory is only pinned to a connection while there is received data in it.
+ */
+class ProvidedBuffer : noncopyable {
+public:
+    ProvidedBuffer() = default;
+    ProvidedBuffer(ProvidedBufferRing* ring, uint16_t bid, size_t len) : ring_(ring), bid_(bid), len_(len) {}
+    ProvidedBuffer(ProvidedBuffer&& other) noexcept
+        : ring_(std::exchange(other.ring_, nullptr)), bid_(other.bid_), len_(std::exchange(other.len_, 0)) {}
+    ProvidedBuffer& operator=(ProvidedBuffer&& other) noexcept {
+        if (this != &other) {
+            release();
+            ring_ = std::exchange(other.ring_, nullptr);
+            bid_ = other.bid_;
+            len_ = std::exchange(other.len_, 0);
+        }
+        return *this;
+    }
+    ~ProvidedBuffer() { release(); }
+
+    inline const char* data() const;
+    size_t size() const { return len_; }
+    // index of the registered buffer that contains data(), -1 if the pool is not registered
+    inline int fixedIndex() const;
+    bool empty() const { return ring_ == nullptr; }
+
+    inline void release();
+
+private:
+    ProvidedBufferRing* ring_ = nullptr;
+    uint16_t bid_ = 0;
+    size_t len_ = 0;
+};
+
+/**
+ * @brief a pool of equally sized buffers registered with io_uring_register_buf_ring
+ *
+ * @details recv sqes only name the group id, the kernel picks a free buffer when data arrives
+ * and reports its id in the upper bits of cqe->flags (IORING_CQE_F_BUFFER).
+ * When the ring is empty the recv fails with -ENOBUFS.
+ */
+class ProvidedBufferRing : noncopyable {
+public:
+    ProvidedBufferRing(io_uring* ring, uint16_t groupId, unsigned count, size_t bufferSize)
+        : ring_(ring), groupId_(groupId), count_(count), bufferSize_(bufferSize) {
+        // NOTE: the kernel requires a power of 2 entries, at most 32768
+        if (count_ == 0 || (count_ & (count_ - 1)) != 0 || count_ > 32768) {
+            throw std::system_error(EINVAL, std::system_category(), "ProvidedBufferRing count");
+        }
+        mask_ = io_uring_buf_ring_mask(count_);
+
+        ringSize_ = count_ * sizeof(io_uring_buf);
+        void* br = mmap(nullptr, ringSize_, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (br == MAP_FAILED) {
+            throw std::system_error(errno, std::system_category(), "mmap buf_ring");
+        }
+        br_ = static_cast<io_uring_buf_ring*>(br);
+
+        void* mem = mmap(nullptr, count_ * bufferSize_, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (mem == MAP_FAILED) {
+            int err = errno;
+            munmap(br_, ringSize_);
+            throw std::system_error(err, std::system_category(), "mmap provided buffers");
+        }
+        memory_ = static_cast<char*>(mem);
+
+        io_uring_buf_reg reg{};
+        reg.ring_addr = reinterpret_cast<uint64_t>(br_);
+        reg.ring_entries = count_;
+        reg.bgid = groupId_;
+        int ret = io_uring_register_buf_ring(ring_, &reg, 0);
+        if (ret < 0) {
+            munmap(memory_, count_ * bufferSize_);
+            munmap(br_, ringSize_);
+            throw std::system_error(-ret, std::system_category(), "io_uring_register_buf_ring");
+        }
+
+        io_uring_buf_ring_init(br_);
+        for (unsigned i = 0; i < count_; i++) {
+            io_uring_buf_ring_add(br_, bufferAt(i), bufferSize_, i, mask_, i);
+        }
+        io_uring_buf_ring_advance(br_, count_);
+    }
+
+    ~ProvidedBufferRing() {
+        if (fixedIndex_ >= 0) {
+            io_uring_unregister_buffers(ring_);
+        }
+        io_uring_unregister_buf_ring(ring_, groupId_);
+        munmap(memory_, count_ * bufferSize_);
+        munmap(br_, ringSize_);
+    }
+
+    uint16_t groupId() const { return groupId_; }
+    size_t bufferSize() const { return bufferSize_; }
+
+    char* bufferAt(uint16_t bid) {
+        return memory_ + static_cast<size_t>(bid) * bufferSize_;
+    }
+
+    /**
+     * @brief wrap the buffer named by a cqe
+     *
+     * @param cqeFlags cqe->flags, must carry IORING_CQE_F_BUFFER
+     * @param len the number of bytes received into it
+     */
+    ProvidedBuffer take(uint32_t cqeFlags, size_t len) {
+        uint16_t bid = static_cast<uint16_t>(cqeFlags >> IORING_CQE_BUFFER_SHIFT);
+        return ProvidedBuffer(this, bid, len);
+    }
+
+    /**
+     * @brief register the whole pool as fixed buffer 0 (io_uring_register_buffers)
+     *
+     * @details the pages are pinned once here instead of on every zero-copy send that reads from them.
+     * Pinned memory counts against RLIMIT_MEMLOCK, so this can fail for a large pool, the caller then
+     * sends from the pool as ordinary memory.
+     *
+     * @return 0 or -errno
+     */
+    int registerFixed() {
+        if (fixedIndex_ >= 0) {
+            return 0;
+        }
+        iovec iov{memory_, count_ * bufferSize_};
+        int ret = io_uring_register_buffers(ring_, &iov, 1);
+        if (ret < 0) {
+            return ret;
+        }
+        fixedIndex_ = 0;
+        return 0;
+    }
+
+    int fixedIndex() const { return fixedIndex_; }
+
+    // hand the buffer back to the kernel
+    void recycle(uint16_t bid) {
+        io_uring_buf_ring_add(br_, bufferAt(bid), bufferSize_, bid, mask_, 0);
+        io_uring_buf_ring_advance(br_, 1);
+    }
+
+private:
+    io_uring* ring_;
+    uint16_t groupId_;
+    unsigned count_;
+    size_t bufferSize_;
+    int mask_ = 0;
+    size_t ringSize_ = 0;
+    io_uring_buf_ring* br_ = nullptr;
+    char* memory_ = nullptr;
+    int fixedIndex_ = -1;
+};
+
+inline const char* ProvidedBuffer::data() const {
+    return ring_ ? ring_->bufferAt(bid_) : nullptr;
+}
+
+inline int ProvidedBuffer::fixedIndex() const {
+    return ring_ ? ring_->fixedIndex() : -1;
+}
+
+inline void ProvidedBuffer::release() {
+    if (ring_) {
+        ring_->recycle(bid_);
+        ring_ = nullptr;
+        len_ = 0;
+    }
+}
@@ -0,0 +1,152 @@
+#pragma once
+#include <algorithm>
+#include <coroutine>
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <sys/uio.h>
+#include "Awaitable.h"
+#include "Cancellation.h"
+#include "utils.h"
+
+/**
+ * @brief a bounded single-producer/single-consumer byte queue linking two coroutines of one scheduler
+ *
+ * @details the producer receives straight into the free space (writeSegments) and commit()s what arrived, the
+ * consumer sends straight from the queued bytes (readPtr) and consume()s what went out, so nothing is copied
+ * in between. The storage is a ring of a power-of-two size: the free space may be split in two by the wrap,
+ * which a readv fills in one go; readPtr gives the contiguous part of the queued bytes, the rest follows.
+ *
+ * A side that cannot go on co_awaits readable() / writable() and is resumed by the other side. The producer is
+ * woken only once a quarter of the ring is free, so it doesn't receive in tiny pieces. close() ends the stream
+ * after the queued bytes, abort() tells the producer that nobody consumes them any more. The waits honour the
+ * CancellationToken of the awaiting coroutine and then return false.
+ *
+ * @note both coroutines must run on the same scheduler thread, nothing here is atomic
+ */
+class ByteQueue : noncopyable {
+public:
+    class WaitAwaitable;
+
+    explicit ByteQueue(size_t capacity)
+        : capacity_(roundUp(capacity)), data_(new char[capacity_]) {}
+
+    size_t capacity() const { return capacity_; }
+    size_t size() const { return tail_ - head_; }
+    bool isClosed() const { return closed_; }
+    bool isAborted() const { return aborted_; }
+
+    // producer: the free space as up to two iovecs, returns how many
+    size_t writeSegments(struct iovec (&vec)[2]) {
+        size_t free = capacity_ - size();
+        size_t offset = tail_ & (capacity_ - 1);
+        size_t first = std::min(free, capacity_ - offset);
+        vec[0].iov_base = data_.get() + offset;
+        vec[0].iov_len = first;
+        vec[1].iov_base = data_.get();
+        vec[1].iov_len = free - first;
+        return vec[1].iov_len ? 2 : 1;
+    }
+
+    // producer: n bytes were written into the free space
+    void commit(size_t n) {
+        tail_ += n;
+        if (consumer_) {
+            std::exchange(consumer_, nullptr).resume();
+        }
+    }
+
+    // producer: no more data, the consumer drains what is queued and then sees size() == 0 && isClosed()
+    void close() {
+        closed_ = true;
+        if (consumer_) {
+            std::exchange(consumer_, nullptr).resume();
+        }
+    }
+
+    // consumer: the contiguous queued bytes
+    const char* readPtr() const { return data_.get() + (head_ & (capacity_ - 1)); }
+    size_t readableBytes() const { return std::min(size(), capacity_ - (head_ & (capacity_ - 1))); }
+
+    // consumer: n bytes were sent
+    void consume(size_t n) {
+        head_ += n;
+        if (producer_ && canProduce()) {
+            std::exchange(producer_, nullptr).resume();
+        }
+    }
+
+    // consumer: it gives up (e.g. the send failed), the producer sees isAborted()
+    void abort() {
+        aborted_ = true;
+        if (producer_) {
+            std::exchange(producer_, nullptr).resume();
+        }
+    }
+
+    // consumer: resumes once there is something to send, or the stream was closed; false when cancelled
+    WaitAwaitable readable();
+    // producer: resumes once a quarter of the queue is free, or the consumer aborted; false when cancelled
+    WaitAwaitable writable();
+
+private:
+    static size_t roundUp(size_t n) {
+        size_t capacity = 4096;
+        while (capacity < n) {
+            capacity <<= 1;
+        }
+        return capacity;
+    }
+
+    bool canConsume() const { return size() > 0 || closed_; }
+    bool canProduce() const { return capacity_ - size() >= capacity_ / 4 || aborted_; }
+
+    size_t capacity_;
+    std::unique_ptr<char[]> data_;
+    // positions in the byte stream, the ring index is position & (capacity_ - 1)
+    size_t head_ = 0;
+    size_t tail_ = 0;
+    bool closed_ = false;
+    bool aborted_ = false;
+    std::coroutine_handle<> producer_ = nullptr;
+    std::coroutine_handle<> consumer_ = nullptr;
+};
+
+class ByteQueue::WaitAwaitable : CancellationCallback {
+public:
+    WaitAwaitable(ByteQueue& queue, bool producer) : queue(queue), producer(producer) {}
+    bool await_ready() noexcept { return producer ? queue.canProduce() : queue.canConsume(); }
+    bool await_suspend(std::coroutine_handle<> handle) noexcept {
+        if (!subscribe(handle)) {
+            cancelled = true;
+            return false;
+        }
+        (producer ? queue.producer_ : queue.consumer_) = handle;
+        return true;
+    }
+    bool await_resume() noexcept {
+        unsubscribe();
+        return !cancelled;
+    }
+    void onCancel() override {
+        cancelled = true;
+        std::exchange(producer ? queue.producer_ : queue.consumer_, nullptr).resume();
+    }
+private:
+    ByteQueue& queue;
+    bool producer;
+    bool cancelled = false;
+};
+
+inline ByteQueue::WaitAwaitable ByteQueue::readable() {
+    return WaitAwaitable(*this, false);
+}
+
+inline ByteQueue::WaitAwaitable ByteQueue::writable() {
+    return WaitAwaitable(*this, true);
+}
+
+template<>
+struct awaitable_traits<ByteQueue::WaitAwaitable>{
+    using type = typename ::DoAsOriginal;
+};
@@ -0,0 +1,141 @@
+#pragma once
+#include <algorithm>
+#include <coroutine>
+#include <cstdint>
+#include <vector>
+#include <liburing.h>
+#include <liburing/io_uring.h>
+#include "IoUringScheduler.h"
+#include "IoUringSchedulerAdapter.h"
+#include "utils.h"
+
+class CancellationToken;
+
+/**
+ * @brief a suspension a CancellationToken ends that is not an sqe in flight: a timer, a stream or a queue
+ * waiting for the other side
+ *
+ * @details the awaiter derives from it, subscribes in await_suspend and unsubscribes in await_resume. cancel()
+ * unsubscribes it and calls onCancel(), which resumes the coroutine with a cancelled result. It also unsubscribes
+ * when it is destroyed, e.g. with the frame of a coroutine that never resumed.
+ */
+class CancellationCallback {
+public:
+    virtual void onCancel() = 0;
+
+protected:
+    CancellationCallback() = default;
+    // awaiters are moved around before they suspend, only an unsubscribed one can be moved
+    CancellationCallback(CancellationCallback&&) noexcept {}
+    CancellationCallback& operator=(const CancellationCallback&) = delete;
+    inline ~CancellationCallback();
+
+    // subscribe to the token of the coroutine, false when it is cancelled already (then the awaiter must not suspend)
+    inline bool subscribe(std::coroutine_handle<> handle);
+    inline void unsubscribe();
+
+private:
+    friend class CancellationToken;
+    CancellationToken* token_ = nullptr;
+};
+
+/**
+ * @brief cooperative cancellation for a tree of Tasks
+ *
+ * @details a token is attached to a Task with TaskBase::setCancellation and is inherited by every Task
+ * that Task awaits. Each operation a SubmitAwaitable submits under the token is tracked by its user_data;
+ * cancel() submits an IORING_OP_ASYNC_CANCEL for every one of them, so they complete with -ECANCELED,
+ * and operations started afterwards complete with -ECANCELED right away, without reaching the kernel.
+ * LinkedOpsAwaitable tracks every step of its chain the same way. Suspensions without an sqe of their own
+ * (MultishotStream::next, ByteQueue waits, sleep_for) subscribe a CancellationCallback and are resumed by
+ * cancel() directly.
+ *
+ * @note the tasks still run to their end, they just see -ECANCELED from their I/O; the token must outlive them.
+ */
+class CancellationToken : noncopyable {
+public:
+    CancellationToken() = default;
+    ~CancellationToken() {
+        for (CancellationCallback* callback : callbacks_) {
+            callback->token_ = nullptr;
+        }
+    }
+
+    void cancel() {
+        if (cancelled_) {
+            return;
+        }
+        cancelled_ = true;
+        IoUringScheduler& scheduler = getScheduler();
+        for (uint64_t data : inflight_) {
+            // getSqe() submits and waits for room when the SQ is full, it only fails when the ring is broken
+            io_uring_sqe* sqe = scheduler.getSqe();
+            if (!sqe) {
+                std::cerr << "Failed to get SQE for cancel" << std::endl;
+                break;
+            }
+            io_uring_prep_cancel64(sqe, data, 0);
+            sqe->user_data = user_data::kNone;
+        }
+        // NOTE: onCancel() resumes a coroutine right here, which may unsubscribe (or destroy) other callbacks,
+        // so they are taken one at a time
+        while (!callbacks_.empty()) {
+            CancellationCallback* callback = callbacks_.back();
+            callbacks_.pop_back();
+            callback->token_ = nullptr;
+            callback->onCancel();
+        }
+    }
+
+    bool isCancelled() const { return cancelled_; }
+
+    // called by SubmitAwaitable and LinkedOpsAwaitable around every operation they submit
+    void track(uint64_t data) { inflight_.push_back(data); }
+    void untrack(uint64_t data) {
+        auto it = std::find(inflight_.begin(), inflight_.end(), data);
+        if (it != inflight_.end()) {
+            *it = inflight_.back();
+            inflight_.pop_back();
+        }
+    }
+
+private:
+    friend class CancellationCallback;
+
+    bool cancelled_ = false;
+    std::vector<uint64_t> inflight_;
+    std::vector<CancellationCallback*> callbacks_;
+};
+
+inline CancellationToken* cancellationOf(std::coroutine_handle<> handle) {
+    return std::coroutine_handle<promise_base>::from_address(handle.address()).promise().cancellation;
+}
+
+inline CancellationCallback::~CancellationCallback() {
+    unsubscribe();
+}
+
+inline bool CancellationCallback::subscribe(std::coroutine_handle<> handle) {
+    CancellationToken* token = cancellationOf(handle);
+    if (!token) {
+        return true;
+    }
+    if (token->isCancelled()) {
+        return false;
+    }
+    token_ = token;
+    token->callbacks_.push_back(this);
+    return true;
+}
+
+inline void CancellationCallback::unsubscribe() {
+    if (!token_) {
+        return;
+    }
+    auto& callbacks = std::exchange(token_, nullptr)->callbacks_;
+    auto it = std::find(callbacks.begin(), callbacks.end(), this);
+    if (it != callbacks.end()) {
+        *it = callbacks.back();
+        callbacks.pop_back();
+    }
+}
@@ -1,4 +1,5 @@
 #pragma once
+#include <chrono>
 #include <cstddef>
 #include <liburing.h>
 #include <liburing/io_uring.h>
@@ -7,6 +8,8 @@
 #include "utils.h"
 #include "Buffer.h"
 #include "BufferOperations.h"
+#include "ZeroCopy.h"
+#include "TimerWheel.h"
 
 class TCPServer;
 
@@ -15,14 +18,83 @@ class Connection : noncopyable{
 public:
 
     Connection(): fd(-1) {}
-    Connection(int fd): fd(fd) {}
+    Connection(IoFd fd): fd(fd) {}
     ~Connection(){
-        close(fd);
+        getScheduler().cancelTimer(idleTimer);
+        if (fd.fixed) {
+            // a direct descriptor only lives in the ring's file table
+            getScheduler().closeDirect(fd.fd);
+        } else if (fd.fd >= 0) {
+            close(fd.fd);
+        }
         // std::cout << "Deconstruct Connection" << std::endl;
     }
 
-    Task<int> read(){
-        auto res = co_await recv(readBuf, fd);
+    IoFd getFd() const { return fd; }
+
+    // send the provided buffers with zero-copy, the sender outlives the connection
+    void setZeroCopySender(ZeroCopySender* sender) { zeroCopy = sender; }
+
+    /**
+     * @brief shut the connection down once the peer sent nothing for timeout
+     *
+     * @details a message only records the time (touch()), the timer is not moved; when it fires it compares
+     * the time of the last message and either shuts the socket down or waits for the rest of the period.
+     * The shutdown (IORING_OP_SHUTDOWN) makes the pending recv return 0, so the handler closes the
+     * connection the usual way.
+     */
+    void setIdleTimeout(std::chrono::milliseconds timeout) {
+        idleTimeout = timeout;
+        touch();
+        armIdleTimer(timeout);
+    }
+
+    /**
+     * @brief shut the socket down (IORING_OP_SHUTDOWN) without waiting, a pending recv then returns 0
+     *
+     * @return false when no sqe was available, try again later
+     */
+    bool shutdown() {
+        io_uring_sqe* sqe = getScheduler().getSqe();
+        if (!sqe) {
+            return false;
+        }
+        io_uring_prep_shutdown(sqe, fd.fd, SHUT_RDWR);
+        fd.apply(sqe);
+        sqe->user_data = user_data::kNone;
+        return true;
+    }
+
+    // record activity for the idle timeout
+    void touch() {
+        if (idleTimeout.count() > 0) {
+            lastActive = std::chrono::steady_clock::now();
+        }
+    }
+
+    /**
+     * @brief receive the next chunk, into a provided buffer (inBuf) when one is available, otherwise into readBuf
+     *
+     * @param timeout 0 for none, otherwise give up (-1) when the peer sent nothing for that long
+     *
+     * @note with the scheduler's inline I/O on it reads into readBuf, a provided buffer can only be selected by
+     * the kernel, i.e. through the ring, and would rule out the synchronous fast path
+     */
+    Task<int> read(std::chrono::nanoseconds timeout = {}){
+        int res;
+        if (getScheduler().inlineIo() && !fd.fixed) {
+            res = co_await recv(readBuf, fd, timeout);
+        } else {
+            res = co_await recv(inBuf, fd, timeout);
+        }
+        if (res == -ENOBUFS) {
+            // all the provided buffers are in flight, use the connection's own buffer this time
+            res = co_await recv(readBuf, fd, timeout);
+        }
+        if (res == -ECANCELED) {
+            // std::cout << "Read timed out" << std::endl;
+            co_return -1;
+        }
         if (res == 0) {
             // std::cout << "Connection closed" << std::endl;
             co_return 0;
@@ -31,6 +103,7 @@ public:
             std::cout << "ERROR: "<< strerror(-res) << std::endl;
             co_return -1;
         }
+        touch();
         // std::cout << "Read " << res << " bytes" << std::endl;
         co_return res;
     }
@@ -45,11 +118,52 @@ public:
         co_return len;
     }
 
+    /**
+     * @brief send the len bytes read() just received, from wherever they landed, then give the buffer back
+     */
+    Task<int> writeBack(size_t len){
+        int res;
+        if (!inBuf.empty() && zeroCopy) {
+            res = co_await zeroCopy->send(std::move(inBuf), fd, len);
+        } else if (!inBuf.empty()) {
+            res = co_await send(inBuf.data(), fd, len);
+            inBuf.release();
+        } else {
+            res = co_await send(readBuf, fd, len);
+        }
+        if (res < 0) {
+            co_return -1;
+        }
+        co_return len;
+    }
+
 
     Buffer readBuf;
     Buffer writeBuf;
+    ProvidedBuffer inBuf;
 
 private:
-    int fd;
+    void armIdleTimer(std::chrono::milliseconds delay) {
+        idleTimer = getScheduler().runAfter(delay, [this] { onIdleTimer(); });
+    }
+
+    void onIdleTimer() {
+        auto idle = std::chrono::steady_clock::now() - lastActive;
+        if (idle < idleTimeout) {
+            armIdleTimer(std::chrono::duration_cast<std::chrono::milliseconds>(idleTimeout - idle) + std::chrono::milliseconds(1));
+            return;
+        }
+        idleTimer = {};
+        if (!shutdown()) {
+            // SQ满了，稍后再试
+            armIdleTimer(std::chrono::milliseconds(1));
+        }
+    }
+
+    IoFd fd;
+    ZeroCopySender* zeroCopy = nullptr;
+    std::chrono::milliseconds idleTimeout{0};
+    std::chrono::steady_clock::time_point lastActive;
+    TimerWheel::TimerId idleTimer;
     // io_uring* ring;
 };
\ No newline at end of file
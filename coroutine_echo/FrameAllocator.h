@@ -0,0 +1,115 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+/**
+ * @brief per-thread recycling allocator for coroutine frames
+ *
+ * @details every Task allocates a frame, and an echo round trip creates several short-lived ones of the same
+ * few sizes. Frames are rounded up to a multiple of kGranularity and freed frames are kept in a free list
+ * per size class, so the next frame of that class is popped from the list instead of going through malloc.
+ * Frames larger than kMaxSize go straight to ::operator new.
+ *
+ * The lists are thread-local and need no locking. A frame freed on another thread than the one that
+ * allocated it just joins the freeing thread's list.
+ *
+ * @note the counters are per thread too, see stats()
+ */
+class FrameAllocator {
+public:
+    static constexpr size_t kGranularity = 64;
+    static constexpr size_t kMaxSize = 2048;
+    static constexpr size_t kClasses = kMaxSize / kGranularity;
+    // blocks kept per class at most, the rest is returned to the heap
+    static constexpr uint32_t kMaxCached = 1024;
+
+    struct Stats {
+        uint64_t hits = 0;      // served from a free list
+        uint64_t misses = 0;    // size class empty, went to the heap
+        uint64_t oversized = 0; // larger than kMaxSize, went to the heap
+        uint64_t cached = 0;    // blocks currently held in the free lists
+    };
+
+    static void* allocate(size_t size) {
+        size_t index = classOf(size);
+        if (index >= kClasses) {
+            if (state_ != State::Destroyed) {
+                cache().stats.oversized++;
+            }
+            return ::operator new(size);
+        }
+        if (state_ == State::Destroyed) {
+            return ::operator new(sizeOf(index));
+        }
+        Cache& c = cache();
+        if (FreeBlock* block = c.heads[index]) {
+            c.heads[index] = block->next;
+            c.counts[index]--;
+            c.stats.hits++;
+            c.stats.cached--;
+            return block;
+        }
+        c.stats.misses++;
+        return ::operator new(sizeOf(index));
+    }
+
+    static void deallocate(void* p, size_t size) noexcept {
+        size_t index = classOf(size);
+        // NOTE: frames destroyed by other thread_local destructors may outlive the cache of this thread
+        if (index >= kClasses || state_ == State::Destroyed) {
+            ::operator delete(p);
+            return;
+        }
+        Cache& c = cache();
+        if (c.counts[index] >= kMaxCached) {
+            ::operator delete(p);
+            return;
+        }
+        auto* block = static_cast<FreeBlock*>(p);
+        block->next = c.heads[index];
+        c.heads[index] = block;
+        c.counts[index]++;
+        c.stats.cached++;
+    }
+
+    // counters of the calling thread
+    static Stats stats() {
+        return state_ == State::Alive ? cache().stats : Stats{};
+    }
+
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    struct Cache {
+        FreeBlock* heads[kClasses] = {};
+        uint32_t counts[kClasses] = {};
+        Stats stats;
+
+        Cache() { state_ = State::Alive; }
+        ~Cache() {
+            for (auto& head : heads) {
+                while (head) {
+                    ::operator delete(std::exchange(head, head->next));
+                }
+            }
+            state_ = State::Destroyed;
+        }
+    };
+
+    enum class State : uint8_t { Unused, Alive, Destroyed };
+
+    static size_t classOf(size_t size) { return size == 0 ? 0 : (size - 1) / kGranularity; }
+    static size_t sizeOf(size_t index) { return (index + 1) * kGranularity; }
+
+    static Cache& cache() {
+        static thread_local Cache c;
+        return c;
+    }
+
+    // trivially destructible, so it can still be read after the Cache of this thread is gone
+    static inline thread_local State state_ = State::Unused;
+};
@@ -2,16 +2,18 @@
 #include <liburing.h>
 #include <system_error>
 #include <iostream>
-#include <map>
 #include <atomic>
 #include <unistd.h>
 #include <coroutine>
 #include <memory>
 #include <vector>
-#include <mutex>
 #include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <algorithm>
 #include <thread>
 #include "Promise.h"
+#include "BufferRing.h"
+#include "TimerWheel.h"
 
 // forward declaration
 template<typename T>
@@ -20,120 +22,396 @@ class Task;
 template<>
 class Task<void>;
 
+/**
+ * 一个SQE产生多个CQE时（multishot请求）的完成回调接口
+ * 只要CQE带有IORING_CQE_F_MORE标志，handler就保持注册状态；
+ * 否则说明内核已经结束了这个请求，调度器会在回调之前将其注销
+ */
+class CompletionHandler {
+public:
+    virtual ~CompletionHandler() = default;
+    virtual void onCompletion(int res, uint32_t flags) = 0;
+};
+
+/**
+ * sqe->user_data 的编码方式，完成事件的分发不需要查表和分配内存：
+ *   0                        -> 不需要回调（取消请求、close等）
+ *   2                        -> 其他调度器用IORING_OP_MSG_RING发来的唤醒
+ *   最低位为0                -> 等待该请求的协程帧地址（coroutine_handle::address()，至少8字节对齐）
+ *   最低位为1                -> handler槽位：slot下标 << 32 | generation << 1 | 1
+ * handler可能在请求还没结束时就被销毁，所以不直接存指针，而是存带generation的槽位下标，
+ * 注销时generation加一，迟到的CQE因为generation不匹配而被丢弃
+ */
+namespace user_data {
+    constexpr uint64_t kNone = 0;
+    constexpr uint64_t kHandlerTag = 1;
+    constexpr uint64_t kWakeup = 2; // 协程帧至少8字节对齐，不会和帧地址冲突
+
+    inline uint64_t fromCoroutine(std::coroutine_handle<> handle) {
+        return reinterpret_cast<uint64_t>(handle.address());
+    }
+
+    inline std::coroutine_handle<> toCoroutine(uint64_t data) {
+        return std::coroutine_handle<>::from_address(reinterpret_cast<void*>(data));
+    }
+}
+
+class IoUringScheduler;
+
+/**
+ * ring的创建方式（setup profile），不同的部署选择不同的方式：
+ *   SqPoll       -> IORING_SETUP_SQPOLL，内核线程轮询SQ，提交不需要系统调用，但每个ring占一个内核线程
+ *   DeferTaskrun -> IORING_SETUP_DEFER_TASKRUN | SINGLE_ISSUER，完成事件只在本线程等待时处理，
+ *                   没有跨核的task_work打断（6.1+），要求所有提交都来自创建ring的线程
+ *   CoopTaskrun  -> IORING_SETUP_COOP_TASKRUN，完成事件不再用IPI打断正在运行的线程（5.19+）
+ *   Plain        -> 不加任何标志
+ * 内核不支持时依次退化：DeferTaskrun -> CoopTaskrun -> Plain，SqPoll -> Plain
+ */
+enum class RingProfile { SqPoll, DeferTaskrun, CoopTaskrun, Plain };
+
+inline const char* ringProfileName(RingProfile profile) {
+    switch (profile) {
+    case RingProfile::SqPoll: return "sqpoll";
+    case RingProfile::DeferTaskrun: return "defer_taskrun";
+    case RingProfile::CoopTaskrun: return "coop_taskrun";
+    case RingProfile::Plain: return "plain";
+    }
+    return "unknown";
+}
+
+struct RingOptions {
+    RingProfile profile = RingProfile::SqPoll;
+    unsigned sqEntries = 512;
+    unsigned cqEntries = 0;       // 0表示内核默认值（SQ的两倍）
+    int sqThreadCpu = -1;         // 仅SqPoll：SQ轮询线程绑定的CPU，-1表示不绑定
+    unsigned sqThreadIdleMs = 0;  // 仅SqPoll：轮询线程空闲多久后休眠，0表示内核默认值（1秒）
+    // 非空时以IORING_SETUP_ATTACH_WQ创建ring，与attachTo共享内核的异步工作线程，
+    // 在SQPOLL模式下也共享同一个SQ轮询线程
+    const IoUringScheduler* attachTo = nullptr;
+};
+
 class IoUringScheduler {
 public:
-    IoUringScheduler() : threadId_(std::this_thread::get_id()) {
-        init();
+    explicit IoUringScheduler(const RingOptions& options = {}) : threadId_(std::this_thread::get_id()) {
+        init(options);
+        // NOTE: 不能用EFD_NONBLOCK，io_uring对O_NONBLOCK的文件直接返回-EAGAIN而不是等待；写端不会因此阻塞
+        wakeupFd_ = eventfd(0, EFD_CLOEXEC);
+        if (wakeupFd_ < 0) {
+            int err = errno;
+            io_uring_queue_exit(&ring);
+            throw std::system_error(err, std::system_category(), "eventfd");
+        }
+        // 第一个在本线程创建的调度器成为当前线程的调度器
+        if (!current_) {
+            current_ = this;
+        }
     }
     
     ~IoUringScheduler() {
         // 清理所有跟踪的协程句柄
-        for (auto handle : managedCoroutines_) {
-            if (handle && !handle.done()) {
-                handle.destroy();
-            }
-        }
+        drainRemoteCoroutines();
+        detachedCoroutines_.destroyAll();
         
+        // 必须在ring退出之前注销
+        bufferRing_.reset();
         io_uring_queue_exit(&ring);
+        close(wakeupFd_);
+
+        if (current_ == this) {
+            current_ = nullptr;
+        }
     }
     
-    void init() {
-        io_uring_params params{};
-        params.flags |= IORING_SETUP_SQPOLL;
-        if (io_uring_queue_init_params(512, &ring, &params) < 0) {
-            throw std::system_error(errno, std::system_category(), "io_uring_queue_init_params");
+    void init(const RingOptions& options = {}) {
+        requestedProfile_ = options.profile;
+        RingProfile profile = options.profile;
+        while (true) {
+            io_uring_params params{};
+            params.flags = flagsOf(profile);
+            if (profile == RingProfile::SqPoll) {
+                if (options.sqThreadCpu >= 0) {
+                    params.flags |= IORING_SETUP_SQ_AFF;
+                    params.sq_thread_cpu = static_cast<uint32_t>(options.sqThreadCpu);
+                }
+                params.sq_thread_idle = options.sqThreadIdleMs;
+            }
+            if (options.cqEntries) {
+                params.flags |= IORING_SETUP_CQSIZE;
+                params.cq_entries = options.cqEntries;
+            }
+            if (options.attachTo) {
+                params.flags |= IORING_SETUP_ATTACH_WQ;
+                params.wq_fd = options.attachTo->ring.ring_fd;
+            }
+            int ret = io_uring_queue_init_params(options.sqEntries, &ring, &params);
+            if (ret == 0) {
+                profile_ = profile;
+                sqEntries_ = params.sq_entries;
+                cqEntries_ = params.cq_entries;
+                return;
+            }
+            // 旧内核不认识的标志返回EINVAL，没有权限的SQPOLL返回EPERM，退化到下一种方式
+            if ((ret != -EINVAL && ret != -EPERM) || profile == RingProfile::Plain) {
+                throw std::system_error(-ret, std::system_category(), "io_uring_queue_init_params");
+            }
+            profile = profile == RingProfile::DeferTaskrun ? RingProfile::CoopTaskrun : RingProfile::Plain;
         }
     }
 
+    // 实际得到的profile，可能比请求的弱
+    RingProfile profile() const { return profile_; }
+    RingProfile requestedProfile() const { return requestedProfile_; }
+    unsigned sqEntries() const { return sqEntries_; }
+    unsigned cqEntries() const { return cqEntries_; }
+
     io_uring* getRing() {
         return &ring;
     }
 
-    uint64_t getNewId() {
-        return next_id.fetch_add(1, std::memory_order_relaxed);
+    // 当前线程的调度器，没有时为nullptr
+    static IoUringScheduler* current() {
+        return current_;
+    }
+
+    // 在第一次调用bufferRing()之前设置provided buffer的数量和大小
+    void setBufferRingSize(unsigned count, size_t bufferSize) {
+        bufferRingCount_ = count;
+        bufferRingBufferSize_ = bufferSize;
     }
 
-    // 使用NOP操作唤醒事件循环
+    // recv共享的provided buffer ring，延迟创建；内核不支持时返回nullptr
+    ProvidedBufferRing* bufferRing() {
+        if (!bufferRing_ && !bufferRingUnsupported_) {
+            try {
+                bufferRing_ = std::make_unique<ProvidedBufferRing>(&ring, 0, bufferRingCount_, bufferRingBufferSize_);
+            } catch (const std::system_error& e) {
+                std::cerr << "provided buffer ring disabled: " << e.what() << std::endl;
+                bufferRingUnsupported_ = true;
+            }
+        }
+        return bufferRing_.get();
+    }
+
+    /**
+     * 注册一个稀疏的固定文件表（direct descriptor），accept_direct可以直接把新连接放进表中，
+     * 之后的recv/send/close都用IOSQE_FIXED_FILE引用表项，省去每次操作的fget/fput
+     * 内核要求表大小不超过RLIMIT_NOFILE，必要时会先提高软限制
+     * 返回实际的表大小，失败时返回0
+     */
+    unsigned registerFixedFiles(unsigned count) {
+        if (fixedFileCount_) {
+            return fixedFileCount_;
+        }
+        rlimit limit{};
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < count) {
+            limit.rlim_cur = std::min<rlim_t>(count, limit.rlim_max);
+            setrlimit(RLIMIT_NOFILE, &limit);
+            getrlimit(RLIMIT_NOFILE, &limit);
+            count = static_cast<unsigned>(std::min<rlim_t>(count, limit.rlim_cur));
+        }
+        int ret = io_uring_register_files_sparse(&ring, count);
+        if (ret < 0) {
+            std::cerr << "io_uring_register_files_sparse: " << strerror(-ret) << std::endl;
+            return 0;
+        }
+        fixedFileCount_ = count;
+        return count;
+    }
+
+    unsigned fixedFileCount() const {
+        return fixedFileCount_;
+    }
+
+    /**
+     * 保证SQ中至少有n个空位：不够时先提交，SQPOLL下再等内核线程取走一些
+     * 只有提交本身失败（ring已经不能用）时返回false
+     * 需要连续的n个sqe时（link链）先调用它，中间不会夹着一次提交
+     */
+    bool reserveSqes(unsigned n) {
+        if (n > ring.sq.ring_entries) {
+            return false;
+        }
+        while (io_uring_sq_space_left(&ring) < n) {
+            int ret = io_uring_submit(&ring);
+            if (ret < 0 && ret != -EINTR) {
+                std::cerr << "io_uring_submit: " << strerror(-ret) << std::endl;
+                return false;
+            }
+            if (io_uring_sq_space_left(&ring) < n) {
+                io_uring_sqring_wait(&ring);
+            }
+        }
+        return true;
+    }
+
+    // 取一个sqe，SQ满了先提交再取；只有ring已经不能用时返回nullptr
+    io_uring_sqe* getSqe() {
+        return reserveSqes(1) ? io_uring_get_sqe(&ring) : nullptr;
+    }
+
+    // 异步关闭固定文件表中的一项，不需要等待结果
+    void closeDirect(unsigned index) {
+        // NOTE: SQ满了也要取到sqe，否则这一项会一直占着文件表
+        if (io_uring_sqe* sqe = getSqe()) {
+            io_uring_prep_close_direct(sqe, index);
+            sqe->user_data = user_data::kNone;
+        }
+    }
+
+    /**
+     * 定时器：调度器持有一个TimerWheel，用一个IORING_OP_TIMEOUT（绝对时间，CLOCK_MONOTONIC）驱动，
+     * 它总是对准时间轮上最近的到期时间，到期后推进时间轮并重新提交
+     * 只能在事件循环线程中调用，回调也在事件循环线程中执行
+     */
+    TimerWheel::TimerId runAfter(std::chrono::milliseconds delay, TimerWheel::Callback cb) {
+        timersChanged_ = true;
+        return timers_.runAfter(delay, std::move(cb));
+    }
+
+    TimerWheel::TimerId runEvery(std::chrono::milliseconds interval, TimerWheel::Callback cb) {
+        timersChanged_ = true;
+        return timers_.runEvery(interval, std::move(cb));
+    }
+
+    bool cancelTimer(TimerWheel::TimerId id) {
+        return timers_.cancel(id);
+    }
+
+    size_t timerCount() const {
+        return timers_.size();
+    }
+
+    /**
+     * 同步快速路径：打开后recv/send先用MSG_DONTWAIT直接调用一次，数据已经就绪（或发送缓冲区有空间）时
+     * 当场完成，协程不挂起，也不经过ring；返回EAGAIN才提交到ring
+     * 每轮事件循环最多kInlineBudget次，用完后本轮剩下的操作都走ring，一个一直有数据的连接不会饿死其他连接
+     * 固定文件（direct descriptor）不能用于普通系统调用，总是走ring
+     */
+    void setInlineIo(bool on) { inlineIo_ = on; }
+    bool inlineIo() const { return inlineIo_; }
+
+    // 取一次快速路径的额度，没有打开或者本轮额度用完时返回false
+    bool takeInlineBudget() {
+        if (!inlineIo_ || inlineBudget_ == 0) {
+            return false;
+        }
+        inlineBudget_--;
+        return true;
+    }
+
+    // 注册multishot请求，返回值作为sqe->user_data
+    uint64_t registerMultishot(CompletionHandler* handler) {
+        uint32_t index;
+        if (freeSlot_ != kNoSlot) {
+            index = freeSlot_;
+            freeSlot_ = handlerSlots_[index].nextFree;
+        } else {
+            index = static_cast<uint32_t>(handlerSlots_.size());
+            handlerSlots_.push_back({});
+        }
+        auto& slot = handlerSlots_[index];
+        slot.handler = handler;
+        return (static_cast<uint64_t>(index) << 32) | (static_cast<uint64_t>(slot.generation) << 1) | user_data::kHandlerTag;
+    }
+
+    // 注销后，该user_data上迟到的CQE会被直接丢弃
+    void unregisterMultishot(uint64_t data) {
+        uint32_t index = static_cast<uint32_t>(data >> 32);
+        auto& slot = handlerSlots_[index];
+        if (slot.handler && slot.generation == generationOf(data)) {
+            slot.handler = nullptr;
+            slot.generation = (slot.generation + 1) & kGenerationMask;
+            slot.nextFree = freeSlot_;
+            freeSlot_ = index;
+        }
+    }
+
+    /**
+     * 唤醒事件循环，任何线程都可以调用，不会碰本ring的SQ
+     * 连续的唤醒会合并：只有wakeupPending_从false变成true的那一次真正发出通知，事件循环取走队列时再清除
+     *   - 调用方是另一个正在运行的调度器：在它自己的ring上提交IORING_OP_MSG_RING，直接往本ring投递一个CQE
+     *     （SQPOLL下不需要系统调用）
+     *   - 否则写eventfd，事件循环上一直挂着一个对它的读请求
+     */
     void wakeup() {
-        // 提交一个NOP操作到io_uring队列
-        io_uring_sqe* sqe = io_uring_get_sqe(&ring);
-        if (!sqe) {
-            std::cerr << "Failed to get SQE for wakeup" << std::endl;
+        if (wakeupPending_.exchange(true)) {
             return;
         }
-        
-        // NOP操作不执行任何I/O，但会产生一个完成事件
-        io_uring_prep_nop(sqe);
-        
-        // 使用特殊ID标记这是一个唤醒操作
-        static uint64_t wakeupId = std::numeric_limits<uint64_t>::max();
-        sqe->user_data = wakeupId;
-        
-        // 提交操作
-        int ret = io_uring_submit(&ring);
-        if (ret <= 0) {
-            std::cerr << "Failed to submit NOP operation: " << strerror(-ret) << std::endl;
+        IoUringScheduler* sender = current_;
+        if (sender && sender != this && sender->running_ && sender->sendMsgRing(this)) {
+            return;
         }
+        signalEventfd();
+    }
+
+    bool isInLoopThread() const {
+        return threadId_.load(std::memory_order_relaxed) == std::this_thread::get_id();
     }
 
-    // 跟踪和管理协程生命周期的方法
+    /**
+     * 跟踪和管理协程生命周期的方法
+     * 在事件循环线程中直接入队；其他线程压入无锁的MPSC队列（链接在promise里，不分配内存）并唤醒事件循环
+     */
     template<typename T>
     void co_spawn(Task<T> task) {
         // 将任务标记为分离状态，生命周期由调度器管理
         task.detach();
         
-        auto handle = task.coro;
-        
-        bool needWakeup = false;
-        {
-            std::lock_guard<std::mutex> lock(coroutinesMutex_);
-            managedCoroutines_.push_back(handle);
+        // 取走句柄，Task析构时不再访问协程帧：交给事件循环线程后，帧随时可能运行完并被销毁
+        auto handle = std::exchange(task.coro, nullptr);
+        auto& promise = std::coroutine_handle<promise_base>::from_address(handle.address()).promise();
+        if (isInLoopThread()) {
+            detachedCoroutines_.push(&promise);
             pendingCoroutines_.push_back(handle);
-            needWakeup = true;
+            return;
         }
-        
+
+        promise_base* head = remoteHead_.load(std::memory_order_relaxed);
+        do {
+            promise.queuedNext = head;
+        } while (!remoteHead_.compare_exchange_weak(head, &promise));
         wakeup();
     }
     
-    // 清理已完成的协程任务
-    void cleanupCompletedTasks() {
-        std::lock_guard<std::mutex> lock(coroutinesMutex_);
-        
-        auto it = managedCoroutines_.begin();
-        while (it != managedCoroutines_.end()) {
-            if (*it && (*it).done()) {
-                // 销毁已完成的协程
-                (*it).destroy();
-                it = managedCoroutines_.erase(it);
-            } else {
-                ++it;
-            }
-        }
+    // 在下一轮事件循环中恢复一个挂起的协程，只能在事件循环线程中调用；不在当前调用栈里恢复，调用方可能正在析构
+    void resumeLater(std::coroutine_handle<> handle) {
+        pendingCoroutines_.push_back(handle);
+    }
+
+    // 还没有结束的分离协程数量（运行完的协程在final_suspend中自己释放）
+    size_t detachedCount() const {
+        return detachedCoroutines_.count;
     }
 
     // 事件循环
     void run() {
         threadId_ = std::this_thread::get_id(); // 记录事件循环线程ID
+        current_ = this;
+        running_ = true;
+        wakeupReader_.arm();
         
         while (true) {
+            inlineBudget_ = kInlineBudget;
+
+            // 恢复待处理的协程（本线程co_spawn的，以及从其他线程的队列中取走的）
+            resumePendingCoroutines();
+
+            // 按时间轮上最近的到期时间设置超时请求
+            armTimer();
+
             // 处理IO事件
             processIOEvents();
-            
-            // 恢复待处理的协程
-            resumePendingCoroutines();
-            
-            // 定期清理已完成任务
-            cleanupCompletedTasks();
         }
     }
     
     // 恢复待处理的协程
     void resumePendingCoroutines() {
-        std::vector<std::coroutine_handle<>> coroutines;
-        {
-            std::lock_guard<std::mutex> lock(coroutinesMutex_);
-            coroutines.swap(pendingCoroutines_);
+        drainRemoteCoroutines();
+        if (pendingCoroutines_.empty()) {
+            return;
         }
+        std::vector<std::coroutine_handle<>> coroutines;
+        coroutines.swap(pendingCoroutines_);
         
         for (auto& handle : coroutines) {
             if (handle && !handle.done()) {
@@ -144,56 +422,269 @@ public:
     
     // 处理IO事件
     void processIOEvents() {
-        // 提交挂起的请求
-        io_uring_submit(&ring);
-        
         // 尝试获取尽可能多的完成事件
         constexpr unsigned MAX_BATCH = 512;
         io_uring_cqe* cqes[MAX_BATCH];
         unsigned completed = io_uring_peek_batch_cqe(&ring, cqes, MAX_BATCH);
 
-        // 如果没有可用的完成事件，则等待至少一个
-        if (completed == 0) {
-            int ret = io_uring_wait_cqe(&ring, &cqes[0]);
-            if (ret < 0) {
-                std::cout << "ERROR in wait_cqe: " << strerror(-ret) << std::endl;
+        if (completed == 0 && pendingCoroutines_.empty()) {
+            // 没有可用的完成事件，也没有待恢复的协程：提交挂起的请求并等待至少一个，非SQPOLL时只需一次系统调用
+            // DEFER_TASKRUN下完成事件也是在这里（GETEVENTS）才被处理
+            int ret = io_uring_submit_and_wait(&ring, 1);
+            if (ret < 0 && ret != -EINTR && ret != -ETIME) {
+                std::cout << "ERROR in submit_and_wait: " << strerror(-ret) << std::endl;
                 return;
             }
             completed = io_uring_peek_batch_cqe(&ring, cqes, MAX_BATCH);
+        } else {
+            // 提交挂起的请求
+            io_uring_submit(&ring);
         }
 
         // 处理所有可用的完成事件
         for (unsigned i = 0; i < completed; i++) {
-            uint64_t id = cqes[i]->user_data;
-            
-            // 对于NOP唤醒操作，不需要特殊处理
-            // NOP操作只是为了唤醒事件循环
-            if (id != std::numeric_limits<uint64_t>::max()) {
-                auto it = handles.find(id);
-                if (it != handles.end()) {
-                    void* addr = reinterpret_cast<void*>(it->second.address());
-                    auto& promise = std::coroutine_handle<promise_base>::from_address(addr).promise();
-                    promise.data = cqes[i]->res;
-                    it->second.resume();
-                    handles.erase(it);
-                }
-            }
+            uint64_t data = cqes[i]->user_data;
+            int res = cqes[i]->res;
+            uint32_t flags = cqes[i]->flags;
+            // 先标记为已读，回调中可能会提交新的请求
             io_uring_cqe_seen(&ring, cqes[i]);
+
+            if (data == user_data::kNone || data == user_data::kWakeup) {
+                // 唤醒只是为了让事件循环从等待中返回，队列在resumePendingCoroutines中取走
+                continue;
+            }
+            if (data & user_data::kHandlerTag) {
+                dispatchHandler(data, res, flags);
+                continue;
+            }
+            auto handle = user_data::toCoroutine(data);
+            auto& promise = std::coroutine_handle<promise_base>::from_address(handle.address()).promise();
+            promise.io_result = res;
+            promise.cqe_flags = flags;
+            handle.resume();
         }
     }
 
-    std::map<uint64_t, std::coroutine_handle<>> handles;
-
 private:
+    static unsigned flagsOf(RingProfile profile) {
+        switch (profile) {
+        case RingProfile::SqPoll:
+            return IORING_SETUP_SQPOLL;
+        case RingProfile::DeferTaskrun:
+            // TASKRUN_FLAG让peek能看到待处理的task_work
+            return IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_TASKRUN_FLAG;
+        case RingProfile::CoopTaskrun:
+            return IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG;
+        case RingProfile::Plain:
+            return 0;
+        }
+        return 0;
+    }
+
+    // eventfd上的读请求，被其他线程的wakeup()触发，完成后立即重新提交
+    class WakeupReader : public CompletionHandler {
+    public:
+        explicit WakeupReader(IoUringScheduler* scheduler) : scheduler_(scheduler) {}
+        void arm() {
+            io_uring_sqe* sqe = io_uring_get_sqe(&scheduler_->ring);
+            if (!sqe) {
+                io_uring_submit(&scheduler_->ring);
+                sqe = io_uring_get_sqe(&scheduler_->ring);
+            }
+            if (!sqe) {
+                std::cerr << "Failed to get SQE for the wakeup eventfd" << std::endl;
+                return;
+            }
+            io_uring_prep_read(sqe, scheduler_->wakeupFd_, &value_, sizeof(value_), 0);
+            sqe->user_data = scheduler_->registerMultishot(this);
+        }
+        void onCompletion(int res, uint32_t flags) override {
+            arm();
+        }
+    private:
+        IoUringScheduler* scheduler_;
+        uint64_t value_ = 0;
+    };
+
+    // 发送方ring上MSG_RING请求的完成回调，对象属于目标调度器；旧内核（5.18之前）不支持时改用eventfd
+    class MsgRingFallback : public CompletionHandler {
+    public:
+        explicit MsgRingFallback(IoUringScheduler* target) : target_(target) {}
+        void onCompletion(int res, uint32_t flags) override {
+            if (res < 0) {
+                msgRingSupported_.store(false, std::memory_order_relaxed);
+                target_->signalEventfd();
+            }
+        }
+    private:
+        IoUringScheduler* target_;
+    };
+
+    // NOTE: 目标调度器必须比发送方ring上在途的MSG_RING活得久（ShardedServer中所有调度器一起退出）
+    bool sendMsgRing(IoUringScheduler* target) {
+        if (!msgRingSupported_.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+        if (!sqe) {
+            return false;
+        }
+        io_uring_prep_msg_ring(sqe, target->ring.ring_fd, 0, user_data::kWakeup, 0);
+        sqe->user_data = registerMultishot(&target->msgRingFallback_);
+        return true;
+    }
+
+    void signalEventfd() {
+        uint64_t one = 1;
+        if (write(wakeupFd_, &one, sizeof(one)) != sizeof(one)) {
+            std::cerr << "Failed to write the wakeup eventfd: " << strerror(errno) << std::endl;
+        }
+    }
+
+    // 取走其他线程co_spawn的协程；先清除唤醒标志再取队列，之后入队的一方一定会重新唤醒
+    void drainRemoteCoroutines() {
+        if (wakeupPending_.load()) {
+            wakeupPending_.store(false);
+        }
+        if (!remoteHead_.load()) {
+            return;
+        }
+        promise_base* node = remoteHead_.exchange(nullptr);
+        // 栈是后进先出，反转成提交顺序
+        promise_base* reversed = nullptr;
+        while (node) {
+            promise_base* next = node->queuedNext;
+            node->queuedNext = reversed;
+            reversed = node;
+            node = next;
+        }
+        for (; reversed; reversed = reversed->queuedNext) {
+            pendingCoroutines_.push_back(std::coroutine_handle<promise_base>::from_promise(*reversed));
+            detachedCoroutines_.push(reversed);
+        }
+    }
+
+    // IORING_OP_TIMEOUT的完成回调：推进时间轮
+    class TimerDriver : public CompletionHandler {
+    public:
+        explicit TimerDriver(IoUringScheduler* scheduler) : scheduler_(scheduler) {}
+        void onCompletion(int res, uint32_t flags) override {
+            scheduler_->timerArmed_ = false;
+            scheduler_->timers_.advance(TimerWheel::Clock::now());
+        }
+    private:
+        IoUringScheduler* scheduler_;
+    };
+
+    void armTimer() {
+        if (timers_.size() == 0 || (timerArmed_ && !timersChanged_)) {
+            return;
+        }
+        timersChanged_ = false;
+        auto deadline = timers_.nextDueTime();
+        if (timerArmed_ && deadline >= timerDeadline_) {
+            return;
+        }
+        io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+        if (!sqe) {
+            // SQ满了，下一轮再设置
+            timersChanged_ = true;
+            return;
+        }
+        auto since = deadline.time_since_epoch();
+        auto seconds = std::chrono::duration_cast<std::chrono::seconds>(since);
+        // NOTE: 内核在取走sqe时才读取timespec（SQPOLL下可能更晚），所以放在成员里
+        __kernel_timespec& ts = timerArmed_ ? timerUpdateTs_ : timerTs_;
+        ts.tv_sec = seconds.count();
+        ts.tv_nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(since - seconds).count();
+        if (timerArmed_) {
+            // 提前已经在等的超时请求，update本身的CQE不需要处理
+            io_uring_prep_timeout_update(sqe, &ts, timerUserData_, IORING_TIMEOUT_ABS);
+            sqe->user_data = user_data::kNone;
+        } else {
+            io_uring_prep_timeout(sqe, &ts, 0, IORING_TIMEOUT_ABS);
+            timerUserData_ = registerMultishot(&timerDriver_);
+            sqe->user_data = timerUserData_;
+            timerArmed_ = true;
+        }
+        timerDeadline_ = deadline;
+    }
+
     io_uring ring;
-    std::atomic<uint64_t> next_id{0};
+    TimerWheel timers_;
+    TimerDriver timerDriver_{this};
+    bool timerArmed_ = false;
+    bool timersChanged_ = false;
+    TimerWheel::Clock::time_point timerDeadline_;
+    uint64_t timerUserData_ = 0;
+    __kernel_timespec timerTs_{};
+    __kernel_timespec timerUpdateTs_{};
+    RingProfile requestedProfile_ = RingProfile::SqPoll;
+    RingProfile profile_ = RingProfile::SqPoll;
+    unsigned sqEntries_ = 0;
+    unsigned cqEntries_ = 0;
+    std::unique_ptr<ProvidedBufferRing> bufferRing_;
+    unsigned bufferRingCount_ = 2048;
+    size_t bufferRingBufferSize_ = 8192;
+    bool bufferRingUnsupported_ = false;
+    unsigned fixedFileCount_ = 0;
+    bool inlineIo_ = false;
+    static constexpr unsigned kInlineBudget = 256;
+    unsigned inlineBudget_ = kInlineBudget;
+
+    static constexpr uint32_t kNoSlot = UINT32_MAX;
+    static constexpr uint32_t kGenerationMask = 0x7fffffff;
+
+    struct HandlerSlot {
+        CompletionHandler* handler = nullptr;
+        uint32_t generation = 0;
+        uint32_t nextFree = kNoSlot;
+    };
+
+    static uint32_t generationOf(uint64_t data) {
+        return static_cast<uint32_t>(data >> 1) & kGenerationMask;
+    }
+
+    void dispatchHandler(uint64_t data, int res, uint32_t flags) {
+        uint32_t index = static_cast<uint32_t>(data >> 32);
+        if (index >= handlerSlots_.size() || !handlerSlots_[index].handler
+            || handlerSlots_[index].generation != generationOf(data)) {
+            // handler已经注销（比如multishot recv在取消生效之前又收到了数据），
+            // 内核为这个CQE选的缓冲区没人会再用，直接还给缓冲区环，否则它就永远从环里消失了
+            if ((flags & IORING_CQE_F_BUFFER) && bufferRing_) {
+                bufferRing_->recycle(static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT));
+            }
+            return;
+        }
+        auto& slot = handlerSlots_[index];
+        // 先注销再回调，回调中可能会销毁handler或者重新注册
+        auto* handler = slot.handler;
+        if (!(flags & IORING_CQE_F_MORE)) {
+            unregisterMultishot(data);
+        }
+        handler->onCompletion(res, flags);
+    }
+
+    // multishot handler的槽位表，空闲槽位串成链表复用
+    std::vector<HandlerSlot> handlerSlots_;
+    uint32_t freeSlot_ = kNoSlot;
     
-    // 使用直接的协程句柄集合替代shared_ptr集合
-    std::vector<std::coroutine_handle<>> managedCoroutines_;
+    // co_spawn的协程：运行完时在final_suspend中自己从链表摘下并释放帧，调度器析构时销毁剩下的
+    DetachedList detachedCoroutines_;
     std::vector<std::coroutine_handle<>> pendingCoroutines_;
+
+    // 其他线程co_spawn的协程（Treiber栈），以及合并唤醒用的标志和eventfd
+    std::atomic<promise_base*> remoteHead_{nullptr};
+    std::atomic<bool> wakeupPending_{false};
+    int wakeupFd_ = -1;
+    WakeupReader wakeupReader_{this};
+    MsgRingFallback msgRingFallback_{this};
+    bool running_ = false;
+    static inline std::atomic<bool> msgRingSupported_{true};
     
-    std::mutex coroutinesMutex_;
-    
-    // 记录事件循环线程ID
-    std::thread::id threadId_;
+    // 记录事件循环线程ID，其他线程的co_spawn会读取它
+    std::atomic<std::thread::id> threadId_;
+
+    // 每个线程各自的调度器
+    static inline thread_local IoUringScheduler* current_ = nullptr;
 };
\ No newline at end of file
@@ -1,21 +1,21 @@
 #pragma once
+#include <exception>
+#include <iostream>
 #include "IoUringScheduler.h"
 
-// 全局单例
-namespace {
-    IoUringScheduler& getGlobalScheduler() {
-        static IoUringScheduler scheduler;
-        return scheduler;
-    }
-}
-
-// 兼容层
+// 兼容层：解析为当前线程的调度器（thread-per-core时每个线程一个ring）
+// NOTE: 当前线程没有调度器时直接终止，不再悄悄创建一个线程局部的ring：没有线程运行它，提交到上面的协程永远不会恢复
 inline IoUringScheduler& getScheduler() {
-    return getGlobalScheduler();
+    IoUringScheduler* scheduler = IoUringScheduler::current();
+    if (!scheduler) {
+        std::cout << "ERROR: getScheduler() called on a thread without an IoUringScheduler" << std::endl;
+        std::terminate();
+    }
+    return *scheduler;
 }
 
-// 全局co_spawn函数
+// 全局co_spawn函数，只能在调度器线程中调用；其他线程用目标调度器的co_spawn，它走远程队列
 template<typename T>
 void co_spawn(Task<T> task) {
     getScheduler().co_spawn(std::move(task));
-}
\ No newline at end of file
+}
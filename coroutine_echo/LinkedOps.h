@@ -0,0 +1,167 @@
+#pragma once
+#include <array>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <tuple>
+#include <utility>
+#include <liburing.h>
+#include <liburing/io_uring.h>
+#include "Awaitable.h"
+#include "Cancellation.h"
+#include "IoUringScheduler.h"
+#include "IoUringSchedulerAdapter.h"
+
+// the outcome of one step of a linked chain
+struct LinkResult {
+    int res = 0;        // cqe->res, stays 0 for a step whose cqe was skipped (IOSQE_CQE_SKIP_SUCCESS)
+    uint32_t flags = 0; // cqe->flags, e.g. the provided buffer id of a recv
+};
+
+/**
+ * @brief submit a fixed sequence of operations as one IOSQE_IO_LINK chain and resume once it is done
+ *
+ * @details every Prep is called with a fresh sqe and fills it with io_uring_prep_* (plus IoFd::apply or any
+ * other sqe flags), the awaitable links each sqe to the next one. The kernel starts a step only after the
+ * previous one succeeded; a failed or short step cancels the rest of the chain, which then complete
+ * with -ECANCELED. A step may set IOSQE_CQE_SKIP_SUCCESS to save its cqe (and a wake-up) when it succeeds,
+ * the last one always posts a cqe.
+ *
+ * Every step is registered as a handler slot of its own, so the cqes may arrive in any order; the
+ * coroutine is resumed when all the steps that post a cqe have reported, and co_await returns one LinkResult
+ * per step.
+ *
+ * The sqes are reserved up front, so a full SQ never splits a chain; if the ring can't take them all every step
+ * reports -EBUSY and nothing is submitted. The chain honours the CancellationToken of the awaiting coroutine like
+ * a SubmitAwaitable: every step is tracked by the token, and a chain started under a cancelled token reports
+ * -ECANCELED for every step without reaching the kernel.
+ *
+ * @note the lambdas are called in await_suspend, i.e. everything they reference must outlive the co_await
+ * expression, which it does when they capture locals of the awaiting coroutine.
+ */
+template<typename... Preps>
+class LinkedOpsAwaitable {
+public:
+    static constexpr size_t kSteps = sizeof...(Preps);
+    static_assert(kSteps > 0, "a chain needs at least one step");
+
+    explicit LinkedOpsAwaitable(IoUringScheduler* scheduler, Preps... preps)
+        : scheduler(scheduler), preps(std::move(preps)...) {}
+
+    bool await_ready() noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle) noexcept {
+        token = cancellationOf(handle);
+        if (token && token->isCancelled()) {
+            fail(-ECANCELED);
+            return false;
+        }
+        if (!scheduler->reserveSqes(kSteps)) {
+            fail(-EBUSY);
+            return false;
+        }
+        waiter = handle;
+        std::array<io_uring_sqe*, kSteps> sqes{};
+        prepare(sqes, std::index_sequence_for<Preps...>{});
+
+        for (size_t i = 0; i < kSteps; i++) {
+            io_uring_sqe* sqe = sqes[i];
+            if (i + 1 < kSteps) {
+                sqe->flags |= IOSQE_IO_LINK;
+            } else {
+                // NOTE: the last cqe is what tells a failed chain from a complete one, never skip it
+                sqe->flags &= ~IOSQE_CQE_SKIP_SUCCESS;
+            }
+            steps[i].owner = this;
+            steps[i].index = i;
+            steps[i].id = scheduler->registerMultishot(&steps[i]);
+            sqe->user_data = steps[i].id;
+            steps[i].skipped = sqe->flags & IOSQE_CQE_SKIP_SUCCESS;
+            if (!steps[i].skipped) {
+                remaining++;
+            }
+            if (token) {
+                token->track(steps[i].id);
+            }
+        }
+        return true;
+    }
+
+    std::array<LinkResult, kSteps> await_resume() noexcept {
+        return results;
+    }
+
+private:
+    struct Step : CompletionHandler {
+        LinkedOpsAwaitable* owner = nullptr;
+        size_t index = 0;
+        uint64_t id = 0;
+        bool skipped = false;
+
+        void onCompletion(int res, uint32_t flags) override {
+            owner->untrack(std::exchange(id, 0));
+            owner->complete(index, res, flags);
+        }
+    };
+
+    // the chain never reached the kernel
+    void fail(int res) {
+        token = nullptr;
+        results.fill(LinkResult{res, 0});
+    }
+
+    void untrack(uint64_t id) {
+        if (token) {
+            token->untrack(id);
+        }
+    }
+
+    template<size_t... I>
+    void prepare(std::array<io_uring_sqe*, kSteps>& sqes, std::index_sequence<I...>) {
+        // the sqes must be taken one after another, the kernel links consecutive entries; reserveSqes made room
+        ((sqes[I] = io_uring_get_sqe(scheduler->getRing()), std::get<I>(preps)(sqes[I])), ...);
+    }
+
+    void complete(size_t index, int res, uint32_t flags) {
+        results[index] = LinkResult{res, flags};
+        // a skipped step only posts when it failed, that cqe does not count
+        if (steps[index].skipped || --remaining > 0) {
+            return;
+        }
+        // drop the cqes of skipped steps that may still come
+        for (auto& step : steps) {
+            if (step.id) {
+                untrack(step.id);
+                scheduler->unregisterMultishot(std::exchange(step.id, 0));
+            }
+        }
+        std::exchange(waiter, nullptr).resume();
+    }
+
+    IoUringScheduler* scheduler;
+    std::tuple<Preps...> preps;
+    std::array<Step, kSteps> steps{};
+    std::array<LinkResult, kSteps> results{};
+    size_t remaining = 0;
+    std::coroutine_handle<> waiter = nullptr;
+    CancellationToken* token = nullptr;
+};
+
+template<typename... Preps>
+struct awaitable_traits<LinkedOpsAwaitable<Preps...>>{
+    using type = typename ::DoAsOriginal;
+};
+
+/**
+ * @brief co_await linked(prep1, prep2, ...) submits the steps as one chain on the current scheduler
+ *
+ * @code
+ * auto [sent, received] = co_await linked(
+ *     [&](io_uring_sqe* sqe) { io_uring_prep_send(sqe, fd, out, len, MSG_WAITALL); },
+ *     [&](io_uring_sqe* sqe) { io_uring_prep_recv(sqe, fd, in, size, 0); });
+ * @endcode
+ */
+template<typename... Preps>
+LinkedOpsAwaitable<std::decay_t<Preps>...> linked(Preps&&... preps) {
+    return LinkedOpsAwaitable<std::decay_t<Preps>...>(&getScheduler(), std::forward<Preps>(preps)...);
+}
@@ -0,0 +1,165 @@
+#pragma once
+#include <cerrno>
+#include <coroutine>
+#include <deque>
+#include <utility>
+#include <liburing.h>
+#include <liburing/io_uring.h>
+#include "Awaitable.h"
+#include "Cancellation.h"
+#include "IoUringScheduler.h"
+#include "utils.h"
+
+template<typename Item>
+class StreamNextAwaitable;
+
+/**
+ * @brief turn one multishot sqe into a stream of items a coroutine can co_await one by one
+ *
+ * @details the derived class prepares the sqe (prepare) and converts every cqe into an Item (deliver -> push).
+ * Items that arrive while nobody is waiting are queued. When the kernel terminates the request
+ * (a cqe without IORING_CQE_F_MORE), it is re-armed by the next call to next().
+ *
+ * pause() stops the kernel side while the queue is too long (backpressure): the request is cancelled, the
+ * items already queued are still handed out, and next() re-arms it once canRearm() says so.
+ *
+ * next() honours the CancellationToken of the awaiting coroutine: once it is cancelled, a next() that finds the
+ * queue empty returns Item{-ECANCELED} instead of waiting.
+ *
+ * @tparam Item what co_await next() returns, may be move-only, constructible from a negative result
+ */
+template<typename Item>
+class MultishotStream : public CompletionHandler, noncopyable {
+public:
+    using item_type = Item;
+
+    StreamNextAwaitable<Item> next() {
+        if (!armed_ && canRearm()) {
+            arm();
+        }
+        return StreamNextAwaitable<Item>(*this);
+    }
+
+    void onCompletion(int res, uint32_t flags) override {
+        if (!(flags & IORING_CQE_F_MORE)) {
+            armed_ = false;
+            if (std::exchange(pausing_, false) && res == -ECANCELED) {
+                // the end of pause(), not of the stream; a waiter drained the queue meanwhile
+                if (waiter_ && canRearm()) {
+                    arm();
+                }
+                return;
+            }
+        }
+        deliver(res, flags);
+    }
+
+    bool isArmed() const { return armed_; }
+    bool isPaused() const { return pausing_; }
+
+    // cancel the armed request, the cqes it still posts before the cancellation are delivered as usual
+    void pause() {
+        if (!armed_ || pausing_) {
+            return;
+        }
+        io_uring_sqe* sqe = scheduler_->getSqe();
+        if (!sqe) {
+            return;
+        }
+        io_uring_prep_cancel64(sqe, id_, 0);
+        sqe->user_data = user_data::kNone;
+        pausing_ = true;
+    }
+
+protected:
+    explicit MultishotStream(IoUringScheduler* scheduler) : scheduler_(scheduler) {}
+
+    virtual ~MultishotStream() {
+        if (armed_) {
+            // late cqes are dropped once unregistered (the scheduler gives their provided buffers back to the
+            // ring), the cancel only stops the kernel side
+            scheduler_->unregisterMultishot(id_);
+            // NOTE: SQ full is not a reason to skip the cancel, getSqe() submits first; without an sqe the request
+            // only ends with the fd
+            if (io_uring_sqe* sqe = scheduler_->getSqe()) {
+                io_uring_prep_cancel64(sqe, id_, 0);
+                sqe->user_data = user_data::kNone;
+            }
+        }
+    }
+
+    virtual void prepare(io_uring_sqe* sqe) = 0;
+    virtual void deliver(int res, uint32_t flags) = 0;
+    // whether next() may re-arm a request that is not armed, by default only once the queue is empty
+    virtual bool canRearm() const { return ready_.empty(); }
+    // called for every item next() hands out
+    virtual void taken(const Item& item) {}
+
+    void push(Item item) {
+        ready_.push_back(std::move(item));
+        if (waiter_) {
+            std::exchange(waiter_, nullptr).resume();
+        }
+    }
+
+    void arm() {
+        io_uring_sqe* sqe = scheduler_->getSqe();
+        if (!sqe) {
+            // the ring does not take requests any more, end the stream like the kernel would
+            deliver(-EBUSY, 0);
+            return;
+        }
+        prepare(sqe);
+        id_ = scheduler_->registerMultishot(this);
+        sqe->user_data = id_;
+        armed_ = true;
+    }
+
+    IoUringScheduler* scheduler_;
+    std::deque<Item> ready_;
+
+private:
+    friend class StreamNextAwaitable<Item>;
+
+    uint64_t id_ = 0;
+    bool armed_ = false;
+    bool pausing_ = false;
+    std::coroutine_handle<> waiter_ = nullptr;
+};
+
+template<typename Item>
+class StreamNextAwaitable : CancellationCallback {
+public:
+    explicit StreamNextAwaitable(MultishotStream<Item>& stream) : stream(stream) {}
+    bool await_ready() noexcept { return !stream.ready_.empty(); }
+    bool await_suspend(std::coroutine_handle<> handle) noexcept {
+        if (!subscribe(handle)) {
+            cancelled = true;
+            return false;
+        }
+        stream.waiter_ = handle;
+        return true;
+    }
+    Item await_resume() {
+        unsubscribe();
+        if (cancelled) {
+            return Item{-ECANCELED};
+        }
+        Item item = std::move(stream.ready_.front());
+        stream.ready_.pop_front();
+        stream.taken(item);
+        return item;
+    }
+    void onCancel() override {
+        cancelled = true;
+        std::exchange(stream.waiter_, nullptr).resume();
+    }
+private:
+    MultishotStream<Item>& stream;
+    bool cancelled = false;
+};
+
+template<typename Item>
+struct awaitable_traits<StreamNextAwaitable<Item>>{
+    using type = typename ::DoAsOriginal;
+};
@@ -1,9 +1,13 @@
 #pragma once
 // #include "Awaitable.h"
 #include <coroutine>
-#include <any>
 #include <cstddef>
+#include <cstdint>
 #include <iostream>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include "FrameAllocator.h"
 
 // forward declaration
 template<typename T>
@@ -11,14 +15,24 @@ class Task;
 template<typename T>
 struct awaitable_traits;
 struct DoAsOriginal;
+class CancellationToken;
+struct DetachedList;
 
 
 struct final_awaiter {
     bool await_ready() noexcept { return false; }
     template<typename PromiseType>
-    auto await_suspend(std::coroutine_handle<PromiseType> handle) noexcept {
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<PromiseType> handle) noexcept {
         auto& promise = handle.promise();
-        return promise.caller ? promise.caller : std::noop_coroutine();
+        if (promise.caller) {
+            return promise.caller;
+        }
+        if (promise.detachedOwner) {
+            // a detached coroutine has nobody to read its result, free the frame right here
+            promise.detachedOwner->erase(&promise);
+            handle.destroy();
+        }
+        return std::noop_coroutine();
     }
     void await_resume() noexcept {}
 };
@@ -34,11 +48,29 @@ struct final_awaiter {
  */
 struct promise_base{
     promise_base() = default;
-    promise_base(std::coroutine_handle<> caller, std::any data) : caller(caller), data(std::move(data)), detached_(false) {}
     std::coroutine_handle<> caller = nullptr;
-    std::any data;
+    // res of the last cqe delivered to this coroutine, SubmitAwaitable reads it in await_resume
+    int io_result = 0;
+    // flags of the last cqe delivered to this coroutine, e.g. the provided buffer id
+    uint32_t cqe_flags = 0;
+    // the I/O of this coroutine is cancelled with the token, inherited from the awaiting coroutine
+    CancellationToken* cancellation = nullptr;
+    // intrusive link of the scheduler's cross-thread spawn queue, a co_spawn from another thread allocates nothing
+    promise_base* queuedNext = nullptr;
+    // the list of the scheduler that owns this detached coroutine, see DetachedList
+    DetachedList* detachedOwner = nullptr;
+    promise_base* prevDetached = nullptr;
+    promise_base* nextDetached = nullptr;
     bool detached_ = false;
 
+    // coroutine frames of every promise type come from the per-thread FrameAllocator
+    static void* operator new(std::size_t size) {
+        return FrameAllocator::allocate(size);
+    }
+    static void operator delete(void* p, std::size_t size) noexcept {
+        FrameAllocator::deallocate(p, size);
+    }
+
     void detach() { detached_ = true; }
     bool is_detached() const { return detached_; }
 
@@ -57,12 +89,80 @@ struct promise_base{
     //     return {};
     // }
 
+    /**
+     * @brief turn what is co_awaited into an awaiter
+     *
+     * @details an Attr becomes its awaitable_traits<Attr>::type, which writes the cqe result into io_result;
+     * awaiters tagged DoAsOriginal are used as they are, anything else goes through its operator co_await.
+     */
+    template<typename AwaitableAttr>
+    auto await_transform(AwaitableAttr&& attr){
+        using real_type = std::remove_cvref_t<AwaitableAttr>;
+        if constexpr(std::is_same_v<real_type, typename awaitable_traits<real_type>::type>){
+            // #pragma message("AwaitableAttr is the same as its type")
+            return attr.operator co_await();
+        } else if constexpr (std::is_same_v<typename ::DoAsOriginal, typename awaitable_traits<real_type>::type>){
+            return attr;
+        }
+        else {
+            using awaitable_type = typename awaitable_traits<real_type>::type;
+            return awaitable_type{attr, &io_result};
+        }
+    }
+
     // NOTE: A better way to implement the final_suspend
     final_awaiter final_suspend() noexcept {
         return {};
     }
 };
 
+/**
+ * @brief intrusive list of the detached coroutines a scheduler is responsible for
+ *
+ * @details a detached coroutine unlinks itself and frees its frame in final_suspend, so reclaiming a
+ * finished coroutine is O(1) and nobody has to scan for done() frames. The frames still linked when the
+ * owner goes away (suspended on I/O, or never started) are destroyed by destroyAll().
+ *
+ * @note not thread-safe, only the owning scheduler's thread links and unlinks
+ */
+struct DetachedList {
+    promise_base* head = nullptr;
+    size_t count = 0;
+
+    void push(promise_base* promise) {
+        promise->detachedOwner = this;
+        promise->prevDetached = nullptr;
+        promise->nextDetached = head;
+        if (head) {
+            head->prevDetached = promise;
+        }
+        head = promise;
+        count++;
+    }
+
+    void erase(promise_base* promise) {
+        if (promise->prevDetached) {
+            promise->prevDetached->nextDetached = promise->nextDetached;
+        } else {
+            head = promise->nextDetached;
+        }
+        if (promise->nextDetached) {
+            promise->nextDetached->prevDetached = promise->prevDetached;
+        }
+        promise->detachedOwner = nullptr;
+        promise->prevDetached = promise->nextDetached = nullptr;
+        count--;
+    }
+
+    void destroyAll() {
+        while (head) {
+            promise_base* promise = head;
+            erase(promise);
+            std::coroutine_handle<promise_base>::from_promise(*promise).destroy();
+        }
+    }
+};
+
 /**
  * @brief Store the result of the coroutine, cooresponding to the Task<T>
  * 
@@ -74,39 +174,22 @@ struct promise_base{
  */
 template<typename T>
 struct promise_type : public promise_base{
-    // T res;
-    promise_type() : promise_base(nullptr, T{}){}
     using value_type = std::remove_reference_t<T>;
 
     template<typename U>
     void return_value(U&& v) { 
-        data = static_cast<value_type>(std::forward<U>(v));
+        value.emplace(std::forward<U>(v));
+    }
+
+    // the co_returned value, moved out by TaskAwaitable::await_resume, T may be move-only
+    value_type take_value() {
+        return std::move(*value);
     }
 
     auto get_return_object() {
         return Task<T>{ *this };
     }
 
-    template<typename AwaitableAttr>
-    auto await_transform(AwaitableAttr&& attr){
-        using real_type = std::remove_reference_t<AwaitableAttr>;
-        if constexpr(std::is_same_v<real_type, typename awaitable_traits<real_type>::type>){
-            // #pragma message("AwaitableAttr is the same as its type")
-            return attr.operator co_await();
-        } else if constexpr (std::is_same_v<typename ::DoAsOriginal, typename awaitable_traits<AwaitableAttr>::type>){
-            #pragma message("AwaitableAttr is DoAsOriginal")
-            return attr;
-        }
-        else {
-            using awaitable_type = typename awaitable_traits<AwaitableAttr>::type;
-            int* d = nullptr;
-            try {
-                d = &std::any_cast<value_type&>(data);
-            } catch (const std::bad_any_cast& e) {
-                std::cout << "ERROR: " << e.what() << std::endl;
-                throw;
-            }
-            return awaitable_type{attr, d};
-        }
-    }
+    std::optional<value_type> value;
+
 };
\ No newline at end of file
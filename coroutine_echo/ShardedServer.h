@@ -0,0 +1,95 @@
+#pragma once
+#include <functional>
+#include <iostream>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "IoUringScheduler.h"
+#include "TCPServer.h"
+#include "utils.h"
+
+/**
+ * @brief thread-per-core echo server, N shards that share nothing
+ *
+ * @details every shard is one thread with its own IoUringScheduler (ring), its own SO_REUSEPORT listener
+ * and its own connection table, the kernel spreads the incoming connections over the listeners.
+ * Every ring is created with the same RingOptions. Optionally the rings after the first one are created
+ * with IORING_SETUP_ATTACH_WQ, so all of them share the SQPOLL kernel thread of shard 0 instead of burning
+ * one per ring.
+ */
+class ShardedServer : noncopyable {
+public:
+    ShardedServer(const std::string& port, unsigned shards, bool shareSqPoll = false, bool pinThreads = true,
+                  RingOptions ringOptions = {})
+        : port_(port), shards_(shards ? shards : 1), shareSqPoll_(shareSqPoll), pinThreads_(pinThreads),
+          ringOptions_(ringOptions) {}
+
+    ~ShardedServer() {
+        for (auto& t : threads_) {
+            if (t.joinable()) {
+                t.join();
+            }
+        }
+    }
+
+    // applied to every shard's TCPServer before it runs
+    void setServerOptions(std::function<void(TCPServer&)> configure) {
+        configure_ = std::move(configure);
+    }
+
+    // shard 0 runs on the calling thread, never returns
+    void run() {
+        pinToCore(0);
+        IoUringScheduler scheduler(ringOptions_);
+        TCPServer server(port_, &scheduler, true);
+
+        const IoUringScheduler* attachTo = shareSqPoll_ ? &scheduler : nullptr;
+        for (unsigned i = 1; i < shards_; i++) {
+            threads_.emplace_back([this, i, attachTo] { runShard(i, attachTo); });
+        }
+
+        std::cout << "running " << shards_ << " shard(s) on port " << port_ << std::endl;
+        if (configure_) {
+            configure_(server);
+        }
+        server.run();
+    }
+
+private:
+    void runShard(unsigned index, const IoUringScheduler* attachTo) {
+        pinToCore(index);
+        // 在本线程构造，getScheduler()在本线程中解析为它
+        RingOptions options = ringOptions_;
+        options.attachTo = attachTo;
+        IoUringScheduler scheduler(options);
+        TCPServer server(port_, &scheduler, true);
+        if (configure_) {
+            configure_(server);
+        }
+        server.run();
+    }
+
+    void pinToCore(unsigned index) {
+        if (!pinThreads_) {
+            return;
+        }
+        unsigned cores = std::thread::hardware_concurrency();
+        if (cores == 0) {
+            return;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(index % cores, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    std::string port_;
+    unsigned shards_;
+    bool shareSqPoll_;
+    bool pinThreads_;
+    RingOptions ringOptions_;
+    std::function<void(TCPServer&)> configure_;
+    std::vector<std::thread> threads_;
+};
@@ -1,8 +1,9 @@
 #pragma once
+#include <chrono>
 #include <cstddef>
 #include <cstring>
 #include <liburing/io_uring.h>
-#include <map>
+#include <memory>
 #include <liburing.h>
 #include "IoUringScheduler.h"
 #include <string>
@@ -12,21 +13,33 @@
 #include <unistd.h>
 #include <utility>
 #include <variant>
+#include "ByteQueue.h"
 #include "Connection.h"
+#include "FrameAllocator.h"
+#include "LinkedOps.h"
+#include "MultishotStream.h"
+#include "Slab.h"
 #include "Socket.h"
 #include "Task.h"
+#include "ZeroCopy.h"
 
 
 struct AcceptAttr : Attr{
     int fd;
     sockaddr_in* clientAddr;
     socklen_t* len;
+    bool direct; // accept into a free slot of the fixed file table, the result is the slot index
 };
 
 class AcceptAwaitable : public SubmitAwaitable{
 public:
-    AcceptAwaitable(AcceptAttr attr, int* res) : SubmitAwaitable{attr.sqe, res}{
-        io_uring_prep_accept(attr.sqe, attr.fd, reinterpret_cast<sockaddr*>(attr.clientAddr), attr.len, 0);
+    AcceptAwaitable(AcceptAttr attr, int* res) : SubmitAwaitable{attr, res}{
+        if (attr.direct) {
+            io_uring_prep_accept_direct(attr.sqe, attr.fd, reinterpret_cast<sockaddr*>(attr.clientAddr), attr.len, 0,
+                                        IORING_FILE_INDEX_ALLOC);
+        } else {
+            io_uring_prep_accept(attr.sqe, attr.fd, reinterpret_cast<sockaddr*>(attr.clientAddr), attr.len, 0);
+        }
     }
 };
 
@@ -35,17 +48,139 @@ struct awaitable_traits<AcceptAttr>{
     using type = AcceptAwaitable;
 };
 
+/**
+ * @brief a multishot accept (IORING_ACCEPT_MULTISHOT) that stays armed on the listening socket
+ *
+ * @details every cqe is a new client fd (or -errno), co_await next() hands them out one by one.
+ * With direct set the connections go straight into the fixed file table and the results are slot indexes.
+ */
+class AcceptStream : public MultishotStream<int> {
+public:
+    AcceptStream(IoUringScheduler* scheduler, int listenFd, bool direct = false)
+        : MultishotStream<int>(scheduler), listenFd_(listenFd), direct_(direct) {}
+    ~AcceptStream() {
+        // the fds nobody took yet
+        for (int fd : ready_) {
+            if (fd < 0) {
+                continue;
+            }
+            if (direct_) {
+                scheduler_->closeDirect(fd);
+            } else {
+                ::close(fd);
+            }
+        }
+    }
+
+protected:
+    void prepare(io_uring_sqe* sqe) override {
+        if (direct_) {
+            io_uring_prep_multishot_accept_direct(sqe, listenFd_, nullptr, nullptr, 0);
+        } else {
+            io_uring_prep_multishot_accept(sqe, listenFd_, nullptr, nullptr, 0);
+        }
+    }
+
+    void deliver(int res, uint32_t flags) override {
+        push(res);
+    }
+
+private:
+    int listenFd_;
+    bool direct_;
+};
+
 class TCPServer{
 
 public:
+    // 连接按slab中的槽位存放，handle带generation，过期的handle查不到连接
+    using ConnectionSlab = Slab<Connection>;
+
     TCPServer() : serverSocket("8080"), scheduler_(nullptr) {
         serverSocket.setReusePort();
     }
-    TCPServer(const std::string& ip_port, IoUringScheduler* scheduler) 
-        : serverSocket(ip_port), scheduler_(scheduler) {
+    /**
+     * @param reusePort bind the listener with SO_REUSEPORT, so one TCPServer per thread can share the port
+     */
+    TCPServer(const std::string& ip_port, IoUringScheduler* scheduler, bool reusePort = false) 
+        : serverSocket(ip_port, reusePort), scheduler_(scheduler) {
     }
     ~TCPServer(){}
 
+    // listen() backlog, SOMAXCONN by default (the kernel still caps it with net.core.somaxconn)
+    void setBacklog(int backlog) { backlog_ = backlog; }
+
+    // keep one multishot accept armed instead of submitting an accept sqe per connection
+    void setMultishotAccept(bool on) { multishotAccept_ = on; }
+
+    // keep one multishot recv armed per connection instead of submitting a recv sqe per message
+    void setMultishotRecv(bool on) { multishotRecv_ = on; }
+
+    // accept into the ring's fixed file table and use IOSQE_FIXED_FILE for every later operation
+    void setDirectDescriptors(bool on) { directFds_ = on; }
+
+    /**
+     * @brief close connections whose peer sent nothing for this long, 0 (default) waits forever
+     *
+     * @note it bounds the single-shot reads (IORING_OP_LINK_TIMEOUT), i.e. handle_client and the first read
+     * of handle_client_linked
+     */
+    void setReadTimeout(std::chrono::milliseconds timeout) { readTimeout_ = timeout; }
+
+    /**
+     * @brief shut down connections idle for this long, 0 (default) keeps them forever
+     *
+     * @details unlike setReadTimeout it covers every echo mode and costs no sqe per message: each connection has
+     * one entry in the scheduler's timer wheel
+     */
+    void setIdleTimeout(std::chrono::milliseconds timeout) { idleTimeout_ = timeout; }
+
+    /**
+     * @brief try recv/send synchronously (MSG_DONTWAIT) before submitting them to the ring
+     *
+     * @details see IoUringScheduler::setInlineIo; it pays off when the data is usually there already
+     * (pipelining clients, low concurrency), otherwise every read costs an extra EAGAIN syscall
+     */
+    void setInlineIo(bool on) { inlineIo_ = on; }
+
+    /**
+     * @brief bound what a connection may have received but not echoed yet
+     *
+     * @details the single-shot and linked echo loops only recv after the previous send completed, so they need
+     * no limit; a multishot recv keeps going, its RecvStream pauses at high and resumes at low queued bytes
+     */
+    void setWatermarks(size_t high, size_t low) {
+        highWatermark_ = high;
+        lowWatermark_ = low;
+    }
+
+    /**
+     * @brief echo every connection with a reader and a writer coroutine joined by a ByteQueue
+     *
+     * @details the next recv overlaps with the send of the previous data, the queue (the high watermark in size,
+     * see setWatermarks) bounds what is received but not yet sent
+     */
+    void setDuplexEcho(bool on) { duplexEcho_ = on; }
+
+    // send each message and recv the next one as one linked chain, instead of a multishot recv
+    void setLinkedEcho(bool on) { linkedEcho_ = on; }
+
+    /**
+     * @brief echo the provided buffers with IORING_OP_SEND_ZC
+     *
+     * @param threshold messages shorter than this still go through a plain send
+     */
+    void setZeroCopySend(bool on, size_t threshold = kDefaultZeroCopyThreshold) {
+        zeroCopySend_ = on;
+        zeroCopyThreshold_ = threshold;
+    }
+
+    /**
+     * @brief print this shard's coroutine frame allocator counters (FrameAllocator::stats) every interval,
+     * 0 (default) never
+     */
+    void setStatsInterval(std::chrono::milliseconds interval) { statsInterval_ = interval; }
+
     /**
      * @brief warp the accept function with coroutine
      * 
@@ -53,9 +188,9 @@ public:
      * @return Task<int> 
      */
     Task<int> accept(InetAddr* clientAddr) {
-        io_uring_sqe *sqe = io_uring_get_sqe(scheduler_->getRing());
+        io_uring_sqe *sqe = scheduler_->getSqe();
         auto len = clientAddr->get_size();
-        int res = co_await AcceptAttr{{sqe}, serverSocket.getFd(), clientAddr->getAddr(), &len};
+        int res = co_await AcceptAttr{{sqe}, serverSocket.getFd(), clientAddr->getAddr(), &len, directFds_};
         // std::cout << "ACCEPTED: " << res << " FROM: " << clientAddr->get_sin_addr() << std::endl;
         if (res < 0) {
             std::cout << "ERROR: "<< strerror(-res) << std::endl;
@@ -66,6 +201,23 @@ public:
 
     Task<void> echo(){
         std::cout << "echo coroutine started" << std::endl;
+        if (multishotAccept_) {
+            AcceptStream acceptStream(scheduler_, serverSocket.getFd(), directFds_);
+            while (true){
+                int clientFd = co_await acceptStream.next();
+                if (clientFd == -EINVAL) {
+                    // NOTE: kernels before 5.19 reject IORING_ACCEPT_MULTISHOT
+                    std::cout << "multishot accept is not supported, fall back to single-shot accept" << std::endl;
+                    multishotAccept_ = false;
+                    break;
+                }
+                if (clientFd < 0) {
+                    std::cout << "ERROR: "<< strerror(-clientFd) << std::endl;
+                    continue;
+                }
+                addConnection(clientFd);
+            }
+        }
         while (true){
             InetAddr clientAddr;
             auto clientFd = co_await accept(&clientAddr);
@@ -73,71 +225,322 @@ public:
                 std::cout << "ERROR: "<< strerror(-clientFd) << std::endl;
                 continue;
             }
-            connections.emplace(std::piecewise_construct_t{}, std::forward_as_tuple(clientFd), std::forward_as_tuple(clientFd));
-            
- 
-            scheduler_->co_spawn(handle_client(clientFd));
+            addConnection(clientFd);
+        }
+    }
 
+    void addConnection(int clientFd){
+        auto [handle, conn] = connections.emplace(IoFd{clientFd, directFds_});
+        conn->setZeroCopySender(zeroCopy_.get());
+        if (idleTimeout_.count() > 0) {
+            conn->setIdleTimeout(idleTimeout_);
+        }
+        // multishot recv and the linked chain need the provided buffer ring
+        if (duplexEcho_) {
+            scheduler_->co_spawn(handle_client_duplex(handle));
+        } else if (linkedEcho_ && scheduler_->bufferRing()) {
+            scheduler_->co_spawn(handle_client_linked(handle));
+        } else if (multishotRecv_ && scheduler_->bufferRing()) {
+            scheduler_->co_spawn(handle_client_stream(handle));
+        } else {
+            scheduler_->co_spawn(handle_client(handle));
         }
     }
 
-    Task<void> handle_client(int clientFd){ 
+    // 每个处理协程持有自己连接的handle，连接在slab中的地址不会变，取一次引用即可
+    Task<void> handle_client(ConnectionSlab::Handle handle){ 
+        Connection& conn = *connections.get(handle);
         while (true){
             // 将Task保存在变量中，确保其生命周期延长到co_await结束
-            Task<int> readTask = connections[clientFd].read();
+            Task<int> readTask = conn.read(readTimeout_);
             auto res = co_await readTask;
             
             if (res <= 0) {
-                connections.erase(clientFd);
+                connections.erase(handle);
                 co_return;
             }
 
-            connections[clientFd].writeBuf.append(connections[clientFd].readBuf.retrieve(res), res);
-            
-            // 同样保存写任务
-            Task<int> writeTask = connections[clientFd].write(res);
+            // 直接从接收缓冲区回显，不再拷贝到writeBuf
+            Task<int> writeTask = conn.writeBack(res);
             auto writeRes = co_await writeTask;
             
             if (writeRes < 0) {
-                connections.erase(clientFd);
+                connections.erase(handle);
                 co_return;
             }
         }
     }
 
+    /**
+     * @brief the echo loop on top of a RecvStream, the only sqes per message are the sends
+     */
+    Task<void> handle_client_stream(ConnectionSlab::Handle handle){
+        Connection& conn = *connections.get(handle);
+        IoFd fd = conn.getFd();
+        bool fallback = false;
+        {
+            // NOTE: the stream has to go (and cancel its recv) before erase() closes the fd
+            RecvStream stream(scheduler_, fd, highWatermark_, lowWatermark_);
+            while (true){
+                RecvChunk chunk = co_await stream.next();
+
+                if (chunk.res == -ENOBUFS) {
+                    // 缓冲区用完了，这一次退回到单次读
+                    Task<int> readTask = conn.read();
+                    chunk.res = co_await readTask;
+                    if (chunk.res > 0) {
+                        Task<int> writeTask = conn.writeBack(chunk.res);
+                        chunk.res = co_await writeTask;
+                    }
+                } else if (chunk.res == -EINVAL && !stream.isArmed()) {
+                    // NOTE: kernels before 6.0 reject IORING_RECV_MULTISHOT
+                    std::cout << "multishot recv is not supported, fall back to single-shot recv" << std::endl;
+                    multishotRecv_ = false;
+                    fallback = true;
+                    break;
+                } else if (chunk.res > 0 && zeroCopy_) {
+                    conn.touch();
+                    Task<int> writeTask = zeroCopy_->send(std::move(chunk.buffer), fd, chunk.res);
+                    chunk.res = co_await writeTask;
+                } else if (chunk.res > 0) {
+                    conn.touch();
+                    Task<int> writeTask = send(chunk.buffer.data(), fd, chunk.res);
+                    chunk.res = co_await writeTask;
+                }
+
+                if (chunk.res <= 0) {
+                    break;
+                }
+            }
+        }
+        if (fallback) {
+            Task<void> fallbackTask = handle_client(handle);
+            co_await fallbackTask;
+            co_return;
+        }
+        connections.erase(handle);
+    }
+
+    /**
+     * @brief the echo loop as send+recv chains: the echo of a message and the recv of the next one are
+     * submitted together (IOSQE_IO_LINK)
+     *
+     * @details the send carries IOSQE_CQE_SKIP_SUCCESS and MSG_WAITALL, so a round trip costs one submission
+     * and one wake-up, the recv cqe. A failed send cancels the recv (-ECANCELED).
+     */
+    Task<void> handle_client_linked(ConnectionSlab::Handle handle){
+        Connection& conn = *connections.get(handle);
+        IoFd fd = conn.getFd();
+        ProvidedBufferRing* pool = scheduler_->bufferRing();
+        ProvidedBuffer pending;
+        while (true){
+            if (pending.empty()) {
+                // 没有待发送的数据（刚建立连接，或者缓冲区用完了），先单独读一次
+                Task<int> readTask = conn.read(readTimeout_);
+                int res = co_await readTask;
+                if (res > 0 && conn.inBuf.empty()) {
+                    Task<int> writeTask = conn.writeBack(res);
+                    res = co_await writeTask;
+                    if (res > 0) {
+                        continue;
+                    }
+                }
+                if (res <= 0) {
+                    break;
+                }
+                pending = std::move(conn.inBuf);
+                continue;
+            }
+
+            size_t len = pending.size();
+            auto [sent, received] = co_await linked(
+                [&](io_uring_sqe* sqe) {
+                    io_uring_prep_send(sqe, fd.fd, pending.data(), len, MSG_WAITALL);
+                    fd.apply(sqe);
+                    sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+                },
+                [&](io_uring_sqe* sqe) {
+                    io_uring_prep_recv(sqe, fd.fd, nullptr, pool->bufferSize(), 0);
+                    fd.apply(sqe);
+                    sqe->flags |= IOSQE_BUFFER_SELECT;
+                    sqe->buf_group = pool->groupId();
+                });
+            pending.release();
+
+            if (received.flags & IORING_CQE_F_BUFFER) {
+                pending = pool->take(received.flags, received.res > 0 ? received.res : 0);
+            }
+            if (received.res > 0) {
+                conn.touch();
+            }
+            if (sent.res < 0 || (received.res <= 0 && received.res != -ENOBUFS)) {
+                break;
+            }
+        }
+        connections.erase(handle);
+    }
+
+    /**
+     * @brief full-duplex echo: the reader keeps receiving into the queue while the writer sends out of it
+     *
+     * @details with a single-shot loop the socket sits idle while a send is in flight; here a pipelining client
+     * always has a recv and a send pending at once. The reader stops at EOF, or when the writer gave up, and the
+     * handler returns once both are done.
+     */
+    Task<void> handle_client_duplex(ConnectionSlab::Handle handle){
+        Connection& conn = *connections.get(handle);
+        ByteQueue queue(highWatermark_);
+        Task<void> reader = duplex_reader(conn, queue);
+        Task<void> writer = duplex_writer(conn, queue);
+        Task<void> both = when_all(reader, writer);
+        co_await both;
+        connections.erase(handle);
+    }
+
+    Task<void> duplex_reader(Connection& conn, ByteQueue& queue){
+        IoFd fd = conn.getFd();
+        while (true){
+            if (!co_await queue.writable() || queue.isAborted()) {
+                break;
+            }
+            struct iovec vec[2];
+            size_t count = queue.writeSegments(vec);
+            Task<int> readTask = recv(vec, count, fd, readTimeout_);
+            int res = co_await readTask;
+            if (res <= 0 || queue.isAborted()) {
+                break;
+            }
+            conn.touch();
+            queue.commit(res);
+        }
+        // 写协程发完剩下的数据后结束
+        queue.close();
+    }
+
+    Task<void> duplex_writer(Connection& conn, ByteQueue& queue){
+        IoFd fd = conn.getFd();
+        while (true){
+            if (!co_await queue.readable()) {
+                break;
+            }
+            size_t len = queue.readableBytes();
+            if (len == 0) {
+                // 读协程已经结束，数据也发完了
+                break;
+            }
+            Task<int> writeTask = send(queue.readPtr(), fd, len);
+            int res = co_await writeTask;
+            if (res < 0) {
+                // 读协程可能还挂在recv上，shutdown让它返回
+                queue.abort();
+                conn.shutdown();
+                break;
+            }
+            queue.consume(len);
+        }
+    }
+
+    /**
+     * @brief an accept of wait_one_accept
+     *
+     * @details the losing accept can still complete before its cancel lands; nobody takes that connection, so it
+     * is closed here and the branch returns -ECANCELED
+     */
+    Task<int> accept_unless_cancelled(InetAddr* clientAddr) {
+        auto self = co_await CoroAwaitable{};
+        Task<int> acceptTask = accept(clientAddr);
+        int clientFd = co_await acceptTask;
+        CancellationToken* token = std::coroutine_handle<promise_base>::from_address(self.address()).promise().cancellation;
+        if (clientFd >= 0 && token && token->isCancelled()) {
+            if (directFds_) {
+                scheduler_->closeDirect(clientFd);
+            } else {
+                close(clientFd);
+            }
+            co_return -ECANCELED;
+        }
+        co_return clientFd;
+    }
+
+    // accept on two sqes at once, the first one wins and the other is cancelled
     Task<void> wait_one_accept(){
-        auto clientAddr1 = new InetAddr();
-        auto clientAddr2 = new InetAddr();
+        InetAddr clientAddr1;
+        InetAddr clientAddr2;
 
-        auto task1 = accept(clientAddr1);
-        auto task2 = accept(clientAddr2);
+        auto task1 = accept_unless_cancelled(&clientAddr1);
+        auto task2 = accept_unless_cancelled(&clientAddr2);
 
         auto res = co_await when_any(task1, task2);
         if (res.result.has_value()){
-            auto v = res.result.value();
-            std::visit([](auto&& arg){
-                // std::cout << "ACCEPTED: " << arg << std::endl;
-            }, v);
+            std::visit([this](int clientFd){
+                if (clientFd >= 0) {
+                    addConnection(clientFd);
+                }
+            }, res.result.value());
         }
-        else {
-            throw res.error;
+        else if (res.error) {
+            std::rethrow_exception(res.error);
         }
     }
 
 
     void run(){
-        serverSocket.listen(5);
+        if (directFds_ && scheduler_->registerFixedFiles(kMaxDirectFds) == 0) {
+            std::cout << "fixed file table is not available, use plain fds" << std::endl;
+            directFds_ = false;
+        }
+        scheduler_->setInlineIo(inlineIo_);
+        if (zeroCopySend_ && scheduler_->bufferRing()) {
+            zeroCopy_ = std::make_unique<ZeroCopySender>(scheduler_, zeroCopyThreshold_);
+        }
+        serverSocket.listen(backlog_);
+        std::cout << "ring profile: " << ringProfileName(scheduler_->profile());
+        if (scheduler_->profile() != scheduler_->requestedProfile()) {
+            std::cout << " (requested " << ringProfileName(scheduler_->requestedProfile()) << ")";
+        }
+        std::cout << ", sq " << scheduler_->sqEntries() << ", cq " << scheduler_->cqEntries() << std::endl;
         // ring.init();
         
+        if (statsInterval_.count() > 0) {
+            scheduler_->runEvery(statsInterval_, [this] { printStats(); });
+        }
+
         scheduler_->co_spawn(echo());
         scheduler_->run();
     }
 
     // IOUring ring;
 private:
+    void printStats() {
+        FrameAllocator::Stats stats = FrameAllocator::stats();
+        uint64_t pooled = stats.hits + stats.misses;
+        std::cout << "[" << std::this_thread::get_id() << "] frames: " << stats.hits << " hits, " << stats.misses
+                  << " misses (" << (pooled ? stats.hits * 100 / pooled : 0) << "% pooled), " << stats.oversized
+                  << " oversized, " << stats.cached << " cached; connections " << connections.size()
+                  << ", coroutines " << scheduler_->detachedCount() << std::endl;
+    }
+
     Socket serverSocket;
     IoUringScheduler* scheduler_; // 非拥有指针
+    int backlog_ = SOMAXCONN;
+    bool multishotAccept_ = true;
+    bool multishotRecv_ = true;
+    bool directFds_ = false;
+    bool linkedEcho_ = false;
+    bool inlineIo_ = false;
+    bool duplexEcho_ = false;
+    size_t highWatermark_ = RecvStream::kDefaultHighWatermark;
+    size_t lowWatermark_ = RecvStream::kDefaultLowWatermark;
+    std::chrono::milliseconds readTimeout_{0};
+    std::chrono::milliseconds idleTimeout_{0};
+    std::chrono::milliseconds statsInterval_{0};
+    // size of the sparse fixed file table, i.e. the most connections with direct descriptors
+    static constexpr unsigned kMaxDirectFds = 100000;
+    bool zeroCopySend_ = false;
+    size_t zeroCopyThreshold_ = kDefaultZeroCopyThreshold;
+    static constexpr size_t kDefaultZeroCopyThreshold = 2048;
+    // 声明在connections之前，连接先析构，在途的零拷贝缓冲区最后归还
+    std::unique_ptr<ZeroCopySender> zeroCopy_;
  
-    using ConnectionMap = std::map<int, Connection>;
-    ConnectionMap connections;
+    ConnectionSlab connections;
 };
\ No newline at end of file
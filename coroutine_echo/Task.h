@@ -1,4 +1,6 @@
 #pragma once
+#include <array>
+#include <atomic>
 #include <coroutine>
 #include <iostream>
 #include <liburing.h>
@@ -7,7 +9,9 @@
 #include <optional>
 #include <tuple>
 #include <utility>
+#include <variant>
 #include "Awaitable.h"
+#include "Cancellation.h"
 #include "Promise.h"
 
 
@@ -70,6 +74,13 @@ public:
         }
     }
 
+    // 此后该协程及其等待的协程中的I/O都可以用token取消，需在协程开始运行之前设置
+    void setCancellation(CancellationToken* token) {
+        if (coro) {
+            coro.promise().cancellation = token;
+        }
+    }
+
     // 查询协程是否已完成
     bool isCompleted() const {
         return coro == nullptr || coro.done();
@@ -126,30 +137,96 @@ public:
     std::exception_ptr error;
 };
 
-template<typename... Task>
-auto when_any(Task&&... tasks) -> ::Task<when_any_state<std::variant<typename std::decay_t<Task>::return_type...>>>
+namespace detail {
+// shared by when_any and its branches, it lives in the when_any frame
+template<typename Result, size_t N>
+struct when_any_shared {
+    when_any_state<Result> state;
+    std::array<CancellationToken, N> tokens;
+    size_t remaining = N;
+    bool decided = false;
+};
+
+// awaits one task of when_any; the first one to finish records its result and cancels the others
+template<size_t I, typename Shared, typename TaskType>
+::Task<void> when_any_branch(Shared& shared, TaskType& task) {
+    auto result = co_await task;
+    if (!shared.decided) {
+        shared.decided = true;
+        shared.state.result.emplace(std::in_place_index<I>, std::move(result));
+        for (size_t i = 0; i < shared.tokens.size(); i++) {
+            if (i != I) {
+                shared.tokens[i].cancel();
+            }
+        }
+    }
+    shared.remaining--;
+}
+}
+
+/**
+ * @brief run the tasks concurrently and return the result of the first one to finish
+ *
+ * @details every task runs under its own CancellationToken. When the first one finishes the others are
+ * cancelled: their pending sqes complete with -ECANCELED, any I/O they start afterwards fails the same way,
+ * so they run to their end quickly. when_any resumes only after all of them are done, so no sqe still
+ * points into a frame, and every branch frame is destroyed before it returns.
+ *
+ * @note the tasks are owned by the caller and must not have been started yet. Whatever a losing task is suspended
+ * on has to honour the token (see CancellationToken for the awaiters that do), otherwise when_any waits until
+ * that task finishes on its own.
+ */
+template<typename... Tasks>
+auto when_any(Tasks&... tasks) -> ::Task<when_any_state<std::variant<typename Tasks::return_type...>>>
 {
-    (std::cout << ... << &tasks ) << std::endl;
-    std::atomic<bool> completed{false};
-    using retutn_type = std::variant<typename std::decay_t<Task>::return_type...>;
+    using result_type = std::variant<typename Tasks::return_type...>;
+    detail::when_any_shared<result_type, sizeof...(Tasks)> shared;
+    auto self = co_await CoroAwaitable{};
+
+    size_t index = 0;
+    (tasks.setCancellation(&shared.tokens[index++]), ...);
+
+    auto branches = [&]<size_t... I>(std::index_sequence<I...>) {
+        return std::make_tuple(detail::when_any_branch<I>(shared, tasks)...);
+    }(std::index_sequence_for<Tasks...>{});
+
+    // start them one by one, a branch that is done right away never needs to resume us
+    std::apply([](auto&... branch) { (branch.resume(), ...); }, branches);
+    std::apply([self](auto&... branch) {
+        ((branch.isCompleted() ? void() : void(branch.coro.promise().caller = self)), ...);
+    }, branches);
+
+    // every branch that finishes resumes us through its final_awaiter
+    while (shared.remaining > 0) {
+        co_await ForgetAwaitable{};
+    }
 
-    auto this_coro = co_await CoroAwaitable{};
-    auto state = when_any_state<retutn_type>();
+    co_return std::move(shared.state);
+}
+
+/**
+ * @brief run the tasks concurrently and resume once every one of them is done
+ *
+ * @details the tasks are started one after another, each runs until its first suspension, and each one that
+ * does not finish right away resumes when_all through its final_awaiter. They inherit the cancellation token
+ * of the awaiting coroutine, like an awaited task does. The results stay in the tasks: co_await on a
+ * finished task returns its value without suspending.
+ *
+ * @note the tasks are owned by the caller and must not have been started yet
+ */
+template<typename... Tasks>
+::Task<void> when_all(Tasks&... tasks)
+{
+    auto self = co_await CoroAwaitable{};
+    CancellationToken* token = std::coroutine_handle<promise_base>::from_address(self.address()).promise().cancellation;
+    ((tasks.coro.promise().cancellation ? void() : void(tasks.coro.promise().cancellation = token)), ...);
 
-    auto start_task = [&state, &completed](auto& task) -> ::Task<void> {
-        auto result = co_await task;
-        if (!completed.exchange(true)) {
-            state.result = retutn_type{std::in_place_index<0>, result};
-        }
-        else {
-            state.error = std::current_exception();
-        }
-        co_return;
-    };
-    
-    (start_task(tasks).then(this_coro), ...);
-    co_await ForgetAwaitable{};
-    // FIXME: cancel all the other tasks, and the IO_uring cancle part should be done in the Task itself
+    // NOTE: the caller is set only after the first resume, a task that finishes inside resume() must not
+    // transfer to this frame while it is still running
+    (tasks.resume(), ...);
+    ((tasks.isCompleted() ? void() : void(tasks.coro.promise().caller = self)), ...);
 
-    co_return state;
-};
\ No newline at end of file
+    while (!(tasks.isCompleted() && ...)) {
+        co_await ForgetAwaitable{};
+    }
+}
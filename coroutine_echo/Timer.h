@@ -0,0 +1,63 @@
+#pragma once
+#include <chrono>
+#include <coroutine>
+#include <utility>
+#include "Awaitable.h"
+#include "Cancellation.h"
+#include "IoUringScheduler.h"
+#include "IoUringSchedulerAdapter.h"
+
+/**
+ * @brief co_await sleep_for(d) suspends the coroutine for d on the scheduler's timer wheel
+ *
+ * @details no sqe per sleep, the wheel is driven by the scheduler's single IORING_OP_TIMEOUT, so a million
+ * sleeping coroutines cost a million wheel entries and nothing in the kernel.
+ *
+ * The sleep honours the CancellationToken of the awaiting coroutine: cancel() removes the timer and resumes it
+ * early. A frame destroyed mid-sleep takes its timer with it.
+ */
+class SleepAwaitable : CancellationCallback {
+public:
+    SleepAwaitable(IoUringScheduler& scheduler, std::chrono::milliseconds duration)
+        : scheduler(scheduler), duration(duration) {}
+    SleepAwaitable(SleepAwaitable&&) = default;
+    ~SleepAwaitable() {
+        if (timer.valid()) {
+            scheduler.cancelTimer(timer);
+        }
+    }
+
+    bool await_ready() noexcept { return duration.count() <= 0; }
+    bool await_suspend(std::coroutine_handle<> handle) {
+        if (!subscribe(handle)) {
+            return false;
+        }
+        waiter = handle;
+        timer = scheduler.runAfter(duration, [this] {
+            timer = {};
+            waiter.resume();
+        });
+        return true;
+    }
+    void await_resume() noexcept { unsubscribe(); }
+
+    void onCancel() override {
+        scheduler.cancelTimer(std::exchange(timer, {}));
+        waiter.resume();
+    }
+
+private:
+    IoUringScheduler& scheduler;
+    std::chrono::milliseconds duration;
+    std::coroutine_handle<> waiter = nullptr;
+    TimerWheel::TimerId timer;
+};
+
+template<>
+struct awaitable_traits<SleepAwaitable>{
+    using type = typename ::DoAsOriginal;
+};
+
+inline SleepAwaitable sleep_for(std::chrono::milliseconds duration) {
+    return SleepAwaitable(getScheduler(), duration);
+}
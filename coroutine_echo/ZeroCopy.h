@@ -0,0 +1,218 @@
+#pragma once
+#include <cerrno>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <liburing.h>
+#include <liburing/io_uring.h>
+#include <sys/socket.h>
+#include "Awaitable.h"
+#include "BufferOperations.h"
+#include "BufferRing.h"
+#include "IoUringScheduler.h"
+#include "Task.h"
+#include "utils.h"
+
+class SendZcAwaitable;
+
+/**
+ * @brief zero-copy sends (IORING_OP_SEND_ZC) out of the provided buffer pool
+ *
+ * @details a zero-copy send completes twice: the first cqe carries the byte count, plus IORING_CQE_F_MORE
+ * when a notification follows, the second one (IORING_CQE_F_NOTIF) says the kernel no longer reads the pages.
+ * The sender is resumed by the first cqe, the buffer is parked here until the notification and only then
+ * goes back to the ring, so the kernel never picks it for a recv while a retransmit may still read it.
+ * When the pool is registered (ProvidedBufferRing::registerFixed) the sends use the fixed buffer and skip
+ * pinning the pages per request.
+ *
+ * Messages shorter than the threshold are sent with a plain send, the page pinning and the extra cqe cost
+ * more than copying a few bytes.
+ */
+class ZeroCopySender : noncopyable {
+public:
+    ZeroCopySender(IoUringScheduler* scheduler, size_t threshold) : scheduler_(scheduler), threshold_(threshold) {
+        if (ProvidedBufferRing* pool = scheduler_->bufferRing()) {
+            int ret = pool->registerFixed();
+            if (ret < 0) {
+                std::cout << "register provided buffers failed (" << strerror(-ret)
+                          << "), zero-copy sends pin the pages per request" << std::endl;
+            }
+        }
+    }
+
+    ~ZeroCopySender() {
+        // the kernel may still read the buffers of sends without their notification, so they must not go back
+        // to the ring yet (a recv could overwrite them): such an entry is left behind owning its buffer and
+        // gives it back, then frees itself, once its last cqe arrives
+        for (auto& entry : entries_) {
+            if (!entry->id) {
+                continue;
+            }
+            if (entry->source) {
+                // the sender still waits for the first cqe: the entry takes the buffer, and the sender fails
+                // with -ECANCELED on the next loop iteration, after this object is gone
+                entry->held = std::move(*entry->source);
+                entry->source = nullptr;
+                *entry->res = -ECANCELED;
+                scheduler_->resumeLater(std::exchange(entry->waiter, nullptr));
+            }
+            entry->owner = nullptr;
+            entry.release();
+        }
+    }
+
+    size_t threshold() const { return threshold_; }
+    bool supported() const { return supported_; }
+
+    // sends waiting for their notification, i.e. buffers the kernel still holds
+    size_t inFlight() const { return inFlight_; }
+
+    /**
+     * @brief send len bytes of buffer and give it back to the ring once the kernel is done with it
+     *
+     * @return len, or -1 on error
+     */
+    inline Task<int> send(ProvidedBuffer buffer, IoFd fd, size_t len);
+
+private:
+    friend class SendZcAwaitable;
+
+    // one in-flight zero-copy send, registered as a multishot handler for both of its cqes
+    struct Pending : CompletionHandler {
+        ZeroCopySender* owner = nullptr;
+        ProvidedBuffer* source = nullptr; // the sender's buffer, until the first cqe
+        ProvidedBuffer held;               // the buffer, from the first cqe until the notification
+        std::coroutine_handle<> waiter = nullptr;
+        int* res = nullptr;
+        uint64_t id = 0;
+        Pending* nextFree = nullptr;
+
+        void onCompletion(int r, uint32_t flags) override {
+            if (!owner) {
+                // left behind by ~ZeroCopySender, only the buffer remains to be given back
+                if (!(flags & IORING_CQE_F_MORE)) {
+                    held.release();
+                    delete this;
+                }
+                return;
+            }
+            if (flags & IORING_CQE_F_NOTIF) {
+                held.release();
+                owner->recycle(this);
+                return;
+            }
+            *res = r;
+            auto handle = std::exchange(waiter, nullptr);
+            if (flags & IORING_CQE_F_MORE) {
+                held = std::move(*source);
+                owner->inFlight_++;
+                // the notification recycles the entry
+                source = nullptr;
+            } else {
+                // nothing was pinned (e.g. an error), the sender keeps its buffer
+                source = nullptr;
+                owner->recycle(this, false);
+            }
+            handle.resume();
+        }
+    };
+
+    Pending* acquire() {
+        if (freeList_) {
+            return std::exchange(freeList_, freeList_->nextFree);
+        }
+        entries_.push_back(std::make_unique<Pending>());
+        entries_.back()->owner = this;
+        return entries_.back().get();
+    }
+
+    void recycle(Pending* entry, bool notified = true) {
+        if (notified) {
+            inFlight_--;
+        }
+        entry->id = 0;
+        entry->nextFree = freeList_;
+        freeList_ = entry;
+    }
+
+    IoUringScheduler* scheduler_;
+    size_t threshold_;
+    bool supported_ = true;
+    size_t inFlight_ = 0;
+    std::vector<std::unique_ptr<Pending>> entries_;
+    Pending* freeList_ = nullptr;
+};
+
+class SendZcAwaitable {
+public:
+    SendZcAwaitable(ZeroCopySender& sender, IoFd fd, ProvidedBuffer& buffer, size_t len)
+        : sender(sender), fd(fd), buffer(buffer), len(len) {}
+
+    bool await_ready() noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle) noexcept {
+        io_uring_sqe* sqe = sender.scheduler_->getSqe();
+        if (!sqe) {
+            // the ring does not take requests any more, the sender keeps its buffer
+            res = -EBUSY;
+            return false;
+        }
+        auto* entry = sender.acquire();
+        entry->source = &buffer;
+        entry->waiter = handle;
+        entry->res = &res;
+
+        // NOTE: MSG_WAITALL makes the kernel retry short sends itself, a short result means the socket failed
+        int fixedIndex = buffer.fixedIndex();
+        if (fixedIndex >= 0) {
+            io_uring_prep_send_zc_fixed(sqe, fd.fd, buffer.data(), len, MSG_WAITALL, 0, fixedIndex);
+        } else {
+            io_uring_prep_send_zc(sqe, fd.fd, buffer.data(), len, MSG_WAITALL, 0);
+        }
+        fd.apply(sqe);
+        entry->id = sender.scheduler_->registerMultishot(entry);
+        sqe->user_data = entry->id;
+        return true;
+    }
+
+    int await_resume() noexcept { return res; }
+
+private:
+    ZeroCopySender& sender;
+    IoFd fd;
+    ProvidedBuffer& buffer;
+    size_t len;
+    int res = 0;
+};
+
+template<>
+struct awaitable_traits<SendZcAwaitable>{
+    using type = typename ::DoAsOriginal;
+};
+
+inline Task<int> ZeroCopySender::send(ProvidedBuffer buffer, IoFd fd, size_t len) {
+    if (supported_ && len >= threshold_) {
+        int res = co_await SendZcAwaitable{*this, fd, buffer, len};
+        if (res == -EINVAL || res == -EOPNOTSUPP) {
+            // NOTE: kernels before 6.0 (or sockets without zero-copy support) reject IORING_OP_SEND_ZC
+            std::cout << "zero-copy send is not supported, fall back to send" << std::endl;
+            supported_ = false;
+            if (buffer.empty()) {
+                // the kernel already took the buffer and owes a notification for it
+                co_return -1;
+            }
+        } else if (res < 0) {
+            std::cout << "ERROR: " << strerror(-res) << std::endl;
+            co_return -1;
+        } else {
+            co_return static_cast<size_t>(res) == len ? static_cast<int>(len) : -1;
+        }
+    }
+    int res = co_await ::send(buffer.data(), fd, len);
+    co_return res;
+}
@@ -1,15 +1,156 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unistd.h>
 #include "TCPServer.h"
+#include "ShardedServer.h"
 #include "IoUringScheduler.h"
 #include "IoUringSchedulerAdapter.h"
-int main() {
-    // 创建调度器实例
-    // IoUringScheduler scheduler;
-    
-    // 使用明确的调度器实例
-    TCPServer server("8080", &getScheduler());
-    
+
+// 用法: simple_tcp [-t 线程数] [-s] [-d] [-z 阈值] [-l] [-p profile] [-q SQ大小] [-Q CQ大小] [-i 空闲毫秒] [-r 毫秒] [-T 毫秒] [-f] [-W 字节] [-x] [-S 毫秒]
+//   -t  线程数，每个线程一个ring和一个SO_REUSEPORT监听socket，0表示CPU核数，默认1
+//   -s  所有ring共享第一个ring的SQPOLL内核线程（IORING_SETUP_ATTACH_WQ）
+//   -d  新连接直接accept到ring的固定文件表中（direct descriptor）
+//   -z  回显时用零拷贝发送（IORING_OP_SEND_ZC），小于阈值（字节）的消息仍然普通发送
+//   -l  每次回显的send和下一次recv作为一条链接的SQE链提交（IOSQE_IO_LINK）
+//   -p  ring的创建方式：sqpoll（默认）、defer（DEFER_TASKRUN+SINGLE_ISSUER）、coop（COOP_TASKRUN）、plain
+//   -q  SQ大小，默认512；-Q CQ大小，默认为SQ的两倍
+//   -i  SQPOLL线程空闲多少毫秒后休眠
+//   -r  单次读的超时（毫秒），客户端超过这个时间没有发数据就断开连接
+//   -T  连接空闲超时（毫秒），由时间轮检查，对所有回显方式都有效
+//   -f  recv/send先用MSG_DONTWAIT同步尝试，数据已就绪时不经过ring（不适用于-d）
+//   -W  每个连接收到还没回显的数据的高水位（字节），超过后暂停multishot recv，降到四分之一时恢复
+//   -x  全双工回显：每个连接一个读协程一个写协程，中间是大小为-W的字节队列，收和发重叠进行
+//   -S  每隔多少毫秒打印一次每个线程的协程帧分配器计数（命中、未命中、超大、缓存的块数）
+static bool parseRingProfile(const std::string& name, RingProfile* profile) {
+    for (RingProfile p : {RingProfile::SqPoll, RingProfile::DeferTaskrun, RingProfile::CoopTaskrun, RingProfile::Plain}) {
+        if (name == ringProfileName(p)) {
+            *profile = p;
+            return true;
+        }
+    }
+    if (name == "defer") {
+        *profile = RingProfile::DeferTaskrun;
+        return true;
+    }
+    if (name == "coop") {
+        *profile = RingProfile::CoopTaskrun;
+        return true;
+    }
+    return false;
+}
+
+int main(int argc, char* argv[]) {
+    unsigned threads = 1;
+    bool shareSqPoll = false;
+    bool directFds = false;
+    bool zeroCopy = false;
+    size_t zeroCopyThreshold = 0;
+    bool linkedEcho = false;
+    RingOptions ringOptions;
+    std::chrono::milliseconds readTimeout{0};
+    std::chrono::milliseconds idleTimeout{0};
+    bool inlineIo = false;
+    size_t highWatermark = RecvStream::kDefaultHighWatermark;
+    bool duplexEcho = false;
+    std::chrono::milliseconds statsInterval{0};
+    int opt;
+    while ((opt = getopt(argc, argv, "t:sdz:lp:q:Q:i:r:T:fW:xS:")) != -1) {
+        switch (opt) {
+        case 't':
+            threads = static_cast<unsigned>(std::atoi(optarg));
+            if (threads == 0) {
+                threads = std::thread::hardware_concurrency();
+            }
+            break;
+        case 's':
+            shareSqPoll = true;
+            break;
+        case 'd':
+            directFds = true;
+            break;
+        case 'z':
+            zeroCopy = true;
+            zeroCopyThreshold = static_cast<size_t>(std::atol(optarg));
+            break;
+        case 'l':
+            linkedEcho = true;
+            break;
+        case 'p':
+            if (!parseRingProfile(optarg, &ringOptions.profile)) {
+                std::cerr << "unknown ring profile: " << optarg << std::endl;
+                return 1;
+            }
+            break;
+        case 'q':
+            ringOptions.sqEntries = static_cast<unsigned>(std::atoi(optarg));
+            break;
+        case 'Q':
+            ringOptions.cqEntries = static_cast<unsigned>(std::atoi(optarg));
+            break;
+        case 'i':
+            ringOptions.sqThreadIdleMs = static_cast<unsigned>(std::atoi(optarg));
+            break;
+        case 'r':
+            readTimeout = std::chrono::milliseconds(std::atol(optarg));
+            break;
+        case 'T':
+            idleTimeout = std::chrono::milliseconds(std::atol(optarg));
+            break;
+        case 'f':
+            inlineIo = true;
+            break;
+        case 'W':
+            highWatermark = static_cast<size_t>(std::atol(optarg));
+            break;
+        case 'x':
+            duplexEcho = true;
+            break;
+        case 'S':
+            statsInterval = std::chrono::milliseconds(std::atol(optarg));
+            break;
+        default:
+            std::cerr << "usage: " << argv[0] << " [-t threads] [-s] [-d] [-z threshold] [-l]"
+                      << " [-p sqpoll|defer|coop|plain] [-q sq] [-Q cq] [-i idle_ms] [-r read_timeout_ms] [-T idle_timeout_ms] [-f] [-W high_watermark_bytes] [-x] [-S stats_interval_ms]" << std::endl;
+            return 1;
+        }
+    }
+
+    if (threads > 1) {
+        // thread-per-core，每个线程独立的调度器、监听socket和连接表
+        ShardedServer server("8080", threads, shareSqPoll, true, ringOptions);
+        server.setServerOptions([=](TCPServer& shard) {
+            shard.setDirectDescriptors(directFds);
+            shard.setZeroCopySend(zeroCopy, zeroCopyThreshold);
+            shard.setLinkedEcho(linkedEcho);
+            shard.setReadTimeout(readTimeout);
+            shard.setIdleTimeout(idleTimeout);
+            shard.setInlineIo(inlineIo);
+            shard.setWatermarks(highWatermark, highWatermark / 4);
+            shard.setDuplexEcho(duplexEcho);
+            shard.setStatsInterval(statsInterval);
+        });
+        server.run();
+        return 0;
+    }
+
+    // 使用明确的调度器实例，它是本线程第一个调度器，getScheduler()也解析为它
+    IoUringScheduler scheduler(ringOptions);
+    TCPServer server("8080", &scheduler);
+    server.setDirectDescriptors(directFds);
+    server.setZeroCopySend(zeroCopy, zeroCopyThreshold);
+    server.setLinkedEcho(linkedEcho);
+    server.setReadTimeout(readTimeout);
+    server.setIdleTimeout(idleTimeout);
+    server.setInlineIo(inlineIo);
+    server.setWatermarks(highWatermark, highWatermark / 4);
+    server.setDuplexEcho(duplexEcho);
+    server.setStatsInterval(statsInterval);
+
     // 运行服务器
     server.run();
-    
+
     return 0;
-}
\ No newline at end of file
+}
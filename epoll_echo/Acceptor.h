@@ -5,12 +5,20 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <cerrno>
+#include <cstdio>
 #include <functional>
+#include <memory>
+#include <vector>
 
 class Acceptor {
 
 public:
     using NewConnectionCallback = std::function<void(int, const InetAddr&)>;
+
+    // 一次可读事件最多accept几个：连接风暴时一次唤醒接走一批，又不至于让这个loop上的连接等太久
+    static constexpr int kMaxAcceptsPerEvent = 64;
+
     Acceptor(EventLoop* loop, const std::string& port) : acceptSocket_(port), 
                                                    acceptChannel_(loop, acceptSocket_.getFd()),
                                                    listenning_(false),
@@ -18,38 +26,49 @@ public:
         loop_ = loop;
         acceptSocket_.setReusePort();
         acceptSocket_.setNonBlocking();
-        acceptChannel_.setReadCallback(std::bind(&Acceptor::handleRead, this));
+        acceptChannel_.setHandler(this);
     }
+    // NOTE: 共享监听时，各loop必须已经停止（或者就是当前线程），它们的Channel在这里摘掉
     ~Acceptor() {
         acceptChannel_.disableAll();
         acceptChannel_.remove();
         ::close(idleFd_);
     }
 
+    // listen()的backlog，默认SOMAXCONN（内核还会用net.core.somaxconn截断）；在listen()之前设置
+    void setBacklog(int backlog) { backlog_ = backlog; }
+
+    // TCP_DEFER_ACCEPT：连接收到第一份数据之后才可以accept，0（默认）表示不用；在listen()之前设置
+    void setDeferAccept(int seconds) { deferAcceptSeconds_ = seconds; }
+
     void listen() {
         listenning_ = true;
-        acceptSocket_.listen(5);
-        acceptChannel_.enableReading();
+        if (deferAcceptSeconds_ > 0) {
+            acceptSocket_.setDeferAccept(deferAcceptSeconds_);
+        }
+        acceptSocket_.listen(backlog_);
+        if (sharedListeners_.empty()) {
+            acceptChannel_.enableReading();
+            return;
+        }
+        // 注册在各自的loop线程中进行
+        for (auto& listener : sharedListeners_) {
+            SharedListener* l = listener.get();
+            l->loop->runInLoop([l]() { l->channel.enableReading(); });
+        }
+    }
+
+    /**
+     * 共享监听：在listen()之前调用，让loop也等待这个listen socket，它accept到的连接直接交给cb，不用再转给别的线程
+     * 各loop的epoll都用EPOLLEXCLUSIVE注册，来一个连接只唤醒其中一个loop而不是全部（惊群）
+     * 调用过之后listen()不再在loop_上接受连接
+     */
+    void shareWith(EventLoop* loop, NewConnectionCallback cb) {
+        sharedListeners_.push_back(std::make_unique<SharedListener>(this, loop, std::move(cb)));
     }
 
     void handleRead() {
-        InetAddr clientAddr;
-        int connfd = acceptSocket_.accept(&clientAddr);
-        if (connfd >= 0) {
-            if (newConnectionCallback_) {
-                newConnectionCallback_(connfd, clientAddr);
-            } else {
-                close(connfd);
-            }
-        } else {
-            // 处理接受连接失败情况
-            if (errno == EMFILE) {
-                ::close(idleFd_);
-                idleFd_ = ::accept(acceptSocket_.getFd(), NULL, NULL);
-                ::close(idleFd_);
-                idleFd_ = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
-            }
-        }
+        acceptBatch(newConnectionCallback_, idleFd_);
     }
 
     void addNewConnectionCallback(const NewConnectionCallback& cb) {
@@ -57,10 +76,75 @@ public:
     }
 
 private:
+    // 共享监听时一个loop里的监听Channel；idleFd各用各的，EMFILE时不同线程不会抢同一个
+    struct SharedListener {
+        SharedListener(Acceptor* acceptor, EventLoop* loop, NewConnectionCallback cb)
+            : acceptor(acceptor), loop(loop), channel(loop, acceptor->acceptSocket_.getFd()), callback(std::move(cb)),
+              idleFd(::open("/dev/null", O_RDONLY | O_CLOEXEC)) {
+            channel.setExclusive(true);
+            channel.setHandler(this);
+        }
+        ~SharedListener() {
+            channel.disableAll();
+            channel.remove();
+            ::close(idleFd);
+        }
+        void handleRead() { acceptor->acceptBatch(callback, idleFd); }
+
+        Acceptor* acceptor;
+        EventLoop* loop;
+        Channel channel;
+        NewConnectionCallback callback;
+        int idleFd;
+    };
+
+    /**
+     * 一直accept到队列空了（EAGAIN）或者用完kMaxAcceptsPerEvent，剩下的水平触发会再报告
+     * 共享监听时几个loop会并发调用，Socket::accept只读fd；EPOLLEXCLUSIVE也可能唤醒不止一个loop，没抢到的得到EAGAIN
+     */
+    void acceptBatch(const NewConnectionCallback& cb, int& idleFd) {
+        for (int i = 0; i < kMaxAcceptsPerEvent; i++) {
+            InetAddr clientAddr;
+            // NOTE: 新连接直接就是非阻塞、close-on-exec的，不用再fcntl
+            int connfd = acceptSocket_.accept(&clientAddr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (connfd >= 0) {
+                if (cb) {
+                    cb(connfd, clientAddr);
+                } else {
+                    close(connfd);
+                }
+                continue;
+            }
+            switch (errno) {
+                case EAGAIN:
+                    return;
+                // 对端在accept之前就断开了，或者被信号打断，接着accept下一个
+                case EINTR:
+                case ECONNABORTED:
+                case EPROTO:
+                    continue;
+                case EMFILE:
+                    // fd用尽：用预留的fd接下这个连接马上关闭，否则它一直留在队列里，水平触发会不停地报告
+                    ::close(idleFd);
+                    idleFd = ::accept(acceptSocket_.getFd(), NULL, NULL);
+                    ::close(idleFd);
+                    idleFd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+                    return;
+                default:
+                    // ENFILE、ENOBUFS、ENOMEM等，等下一次事件再试
+                    perror("Acceptor::acceptBatch");
+                    return;
+            }
+        }
+    }
+
     EventLoop* loop_;
     Socket acceptSocket_;
     Channel acceptChannel_;
     NewConnectionCallback newConnectionCallback_;
     bool listenning_;
     int idleFd_;  // 用于处理文件描述符用尽的情况
+    int backlog_ = SOMAXCONN;
+    int deferAcceptSeconds_ = 0;
+    std::vector<std::unique_ptr<SharedListener>> sharedListeners_;
 };
\ No newline at end of file
@@ -10,6 +10,8 @@
 class Buffer {
 public:
     static const size_t kInitialSize = 1024;
+    // readFromFd先把放不下的部分读到每个线程的一块临时区域里，再追加进来
+    static const size_t kExtraBufferSize = 65536;
     
     Buffer() : buffer_(kInitialSize), readerIndex_(0), writerIndex_(0) {}
     
@@ -43,17 +45,23 @@ public:
         writerIndex_ += len;
     }
     
+    // 一次readFromFd最多读多少，读到的比这少说明socket已经读空了
+    size_t maxReadSize() const {
+        const size_t writable = writableBytes();
+        return writable < kExtraBufferSize ? writable + kExtraBufferSize : writable;
+    }
+
     ssize_t readFromFd(int fd, int* savedErrno) {
-        char extrabuf[65536];
+        char* extrabuf = extraBuffer();
         struct iovec vec[2];
         const size_t writable = writableBytes();
         
         vec[0].iov_base = beginWrite();
         vec[0].iov_len = writable;
         vec[1].iov_base = extrabuf;
-        vec[1].iov_len = sizeof extrabuf;
+        vec[1].iov_len = kExtraBufferSize;
         
-        const int iovcnt = (writable < sizeof extrabuf) ? 2 : 1;
+        const int iovcnt = (writable < kExtraBufferSize) ? 2 : 1;
         const ssize_t n = ::readv(fd, vec, iovcnt);
         
         if (n < 0) {
@@ -69,6 +77,12 @@ public:
     }
     
 private:
+    // NOTE: 每个线程一块（一个loop一个线程），读完马上拷走，不用每次读都在栈上占64KB，也不用每个连接各留一块
+    static char* extraBuffer() {
+        static thread_local char extrabuf[kExtraBufferSize];
+        return extrabuf;
+    }
+
     char* begin() { return &*buffer_.begin(); }
     const char* begin() const { return &*buffer_.begin(); }
     
@@ -1,7 +1,9 @@
 #pragma once
 #include <sys/epoll.h>
+#include <cstdint>
 #include <vector>
 #include <functional>
+#include <memory>
 #include <unistd.h>
 #include <iostream>
 #include "utils.h"  // 确保包含 noncopyable
@@ -13,15 +15,28 @@ class Channel;
 // EPoller定义移至单独的头文件
 class EPoller;
 
-class Channel : noncopyable {
+/**
+ * 一个fd在epoll中的注册和它的事件处理者
+ * 处理者用setHandler(h)挂上：h提供handleRead/handleWrite/handleClose/handleError中需要的几个（可以是private，
+ * 把Channel声明为friend），handleEvent()通过一个按处理者类型生成的函数直接调用它们，一个事件只有一次间接调用
+ * 冷路径（wakeup、timerfd）可以继续用setXxxCallback挂std::function，回调存在单独分配的对象里
+ * 分发要用的字段（处理者、fd、事件）都在一个cache line里
+ */
+class alignas(64) Channel : noncopyable {
 public:
     using EventCallback = std::function<void()>;
-    Channel(EventLoop* loop, int fd) : loop(loop), fd(fd), events(0), revents(0), index(-1) {
+    Channel(EventLoop* loop, int fd) : fd(fd), events(0), revents(0), index(-1), loop(loop) {
     }
 
     ~Channel(){
     }
 
+    template<typename Handler>
+    void setHandler(Handler* handler) {
+        this->handler = handler;
+        dispatcher = &dispatch<Handler>;
+    }
+
     void setFd(int fd) {
         this->fd = fd;
     }
@@ -31,19 +46,19 @@ public:
     }
 
     void setReadCallback(EventCallback cb){
-        readCallback = std::move(cb);
+        callbacks().read = std::move(cb);
     }
 
     void setWriteCallback(EventCallback cb){
-        writeCallback = std::move(cb);
+        callbacks().write = std::move(cb);
     }
 
     void setCloseCallback(EventCallback cb){
-        closeCallback = std::move(cb);
+        callbacks().close = std::move(cb);
     }
 
     void setErrorCallback(EventCallback cb){
-        errorCallback = std::move(cb);
+        callbacks().error = std::move(cb);
     }
 
     void setRevents(int revents){
@@ -79,42 +94,105 @@ public:
         update();
     }
 
+    // 边沿触发（EPOLLET）：状态变化时才通知一次，使用者要把数据读到EAGAIN（或者短读）为止，否则不会再有通知；
+    // 在第一次enable之前设置
+    void setEdgeTriggered(bool on) { edgeTriggered = on; }
+    bool isEdgeTriggered() const { return edgeTriggered; }
+
+    // EPOLLEXCLUSIVE：几个loop的epoll都在等同一个fd（共享的listen socket）时，一个事件只唤醒其中一个，不会惊群
+    // 在第一次enable之前设置
+    void setExclusive(bool on) { exclusive = on; }
+    bool isExclusive() const { return exclusive; }
+
+    // 交给epoll_ctl的事件：关心的事件加上触发方式
+    uint32_t epollEvents() const {
+        uint32_t result = static_cast<uint32_t>(events);
+        if (edgeTriggered) {
+            result |= EPOLLET;
+        }
+        if (exclusive) {
+            // NOTE: EPOLLEXCLUSIVE不能和EPOLLPRI一起用，否则EINVAL
+            result = (result & ~static_cast<uint32_t>(EPOLLPRI)) | EPOLLEXCLUSIVE;
+        }
+        return result;
+    }
+
     void handleEvent(){
-        if(revents & (EPOLLIN | EPOLLPRI)){
-            if(readCallback){
-                readCallback();
+        if (dispatcher) {
+            dispatcher(handler, revents);
+        }
+    }
+
+    bool isReading() const { return events & EPOLLIN; }
+    bool isWriting() const { return events & EPOLLOUT; }
+
+    int getFd() const { return fd; }
+    int getEvents() const { return events; }
+    int getRevents() const { return revents; }
+    int getIndex() const { return index; }
+    void setIndex(int idx) { index = idx; }
+
+private:
+    using Dispatcher = void (*)(void* handler, int revents);
+
+    // 事件的处理顺序：读、写、错误、挂断；处理者没有的那一种就跳过
+    template<typename Handler>
+    static void dispatch(void* handler, int revents) {
+        Handler* h = static_cast<Handler*>(handler);
+        if constexpr (requires { h->handleRead(); }) {
+            if (revents & (EPOLLIN | EPOLLPRI)) {
+                h->handleRead();
             }
         }
-        if(revents & EPOLLOUT){
-            if(writeCallback){
-                writeCallback();
+        if constexpr (requires { h->handleWrite(); }) {
+            if (revents & EPOLLOUT) {
+                h->handleWrite();
             }
         }
-        if(revents & EPOLLERR){
-            if(errorCallback){
-                errorCallback();
+        if constexpr (requires { h->handleError(); }) {
+            if (revents & EPOLLERR) {
+                h->handleError();
             }
         }
-        if(revents & EPOLLHUP){
-            if(closeCallback){
-                closeCallback();
+        if constexpr (requires { h->handleClose(); }) {
+            if (revents & EPOLLHUP) {
+                h->handleClose();
             }
         }
     }
 
-    int getFd() const { return fd; }
-    int getEvents() const { return events; }
-    int getIndex() const { return index; }
-    void setIndex(int idx) { index = idx; }
+    // std::function的适配器
+    struct Callbacks {
+        EventCallback read;
+        EventCallback write;
+        EventCallback close;
+        EventCallback error;
+
+        void handleRead() { if (read) read(); }
+        void handleWrite() { if (write) write(); }
+        void handleClose() { if (close) close(); }
+        void handleError() { if (error) error(); }
+    };
+
+    Callbacks& callbacks() {
+        if (!callbackAdapter) {
+            callbackAdapter = std::make_unique<Callbacks>();
+            setHandler(callbackAdapter.get());
+        }
+        return *callbackAdapter;
+    }
 
-private:
-    EventCallback readCallback;
-    EventCallback writeCallback;
-    EventCallback closeCallback;
-    EventCallback errorCallback;
-    EventLoop* loop;
+    // 分发时用到的放在前面
+    void* handler = nullptr;
+    Dispatcher dispatcher = nullptr;
     int fd;
     int events;
     int revents;
     int index;
-};
\ No newline at end of file
+    bool edgeTriggered = false;
+    bool exclusive = false;
+    EventLoop* loop;
+    std::unique_ptr<Callbacks> callbackAdapter;
+};
+
+static_assert(sizeof(Channel) == 64, "Channel should fit in one cache line");
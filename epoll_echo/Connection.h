@@ -3,69 +3,338 @@
 #include "Channel.h"
 #include "Socket.h"
 #include "Buffer.h"
+#include "EventLoop.h"
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
 #include <functional>
+#include <iostream>
 #include <memory>
 #include <string>
+#include <string_view>
+#include <sys/socket.h>
 
 class Connection : noncopyable {
 public:
-    using ReadCallback = std::function<void(const std::string&)>;
-    
+    // 参数指向输入缓冲区里的数据，只在回调期间有效，要留到之后用就自己拷贝
+    using ReadCallback = std::function<void(std::string_view)>;
+    using CloseCallback = std::function<void(int)>;
+    // 参数是当前输出缓冲区里积压的字节数
+    using WatermarkCallback = std::function<void(size_t)>;
+
+    static constexpr size_t kDefaultHighWatermark = 256 * 1024;
+    static constexpr size_t kDefaultLowWatermark = 64 * 1024;
+    // 一次读事件最多读几次：一个一直在发的连接不能独占loop，用完了就让给本轮的其他连接
+    static constexpr int kMaxReadsPerEvent = 16;
+
+    // NOTE: sockfd必须是非阻塞的（Acceptor用SOCK_NONBLOCK accept），否则对端不读时send会卡住整个事件循环
     Connection(EventLoop* loop, int sockfd, const InetAddr& peerAddr)
-        : loop_(loop),
-          channel_(new Channel(loop, sockfd))
+        : channel_(loop, sockfd),
+          loop_(loop)
     {
-        channel_->setReadCallback([this]() { handleRead(); });
-        channel_->setWriteCallback([this]() { handleWrite(); });
-        channel_->setCloseCallback([this]() { handleClose(); });
-        channel_->setErrorCallback([this]() { handleError(); });
+        // 事件直接分发到handleRead/handleWrite/handleClose/handleError
+        channel_.setHandler(this);
     }
     
     ~Connection() {
-        channel_->disableAll();
-        channel_->remove();
+        loop_->cancelTimer(idleTimer_);
+        // EPOLL_CTL_DEL不管注册的是什么事件，不需要先disableAll
+        channel_.remove();
+        ::close(channel_.getFd());
     }
     
     void setReadCallback(ReadCallback cb) { readCallback_ = std::move(cb); }
+    // 连接关闭时调用，参数是fd；Server在这里安排销毁Connection
+    void setCloseCallback(CloseCallback cb) { closeCallback_ = std::move(cb); }
+
+    /**
+     * 输出缓冲区的高低水位（背压）：对端不读时，积压涨到high就暂停读这个连接，不再替它收数据，
+     * 发送出去降到low以下再恢复读；所以一个慢的对端最多让服务器替它缓存high加上一次读的数据
+     * 越过水位时还会调用对应的回调
+     */
+    void setWatermarks(size_t high, size_t low) {
+        highWatermark_ = high;
+        lowWatermark_ = low < high ? low : high;
+    }
+    void setHighWatermarkCallback(WatermarkCallback cb) { highWatermarkCallback_ = std::move(cb); }
+    void setLowWatermarkCallback(WatermarkCallback cb) { lowWatermarkCallback_ = std::move(cb); }
+
+    /**
+     * 发送数据：输出缓冲区为空时先直接写，写不完的部分追加到输出缓冲区，打开EPOLLOUT，在handleWrite中继续
+     * 已经积压的数据总在前面，新数据只能排在后面，顺序不会乱
+     */
+    void send(const char* data, size_t len) {
+        if (closed_) {
+            return;
+        }
+        size_t written = 0;
+        if (outputBuffer_.readableBytes() == 0) {
+            // NOTE: MSG_NOSIGNAL，对端已经关闭时返回EPIPE而不是用SIGPIPE杀掉进程
+            ssize_t n = ::send(channel_.getFd(), data, len, MSG_NOSIGNAL);
+            if (n >= 0) {
+                written = static_cast<size_t>(n);
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                handleClose();
+                return;
+            }
+        }
+        if (written < len) {
+            outputBuffer_.append(data + written, len - written);
+            startWriting();
+            if (!readPaused_ && outputBuffer_.readableBytes() >= highWatermark_) {
+                readPaused_ = true;
+                pauseReading();
+                if (highWatermarkCallback_) {
+                    highWatermarkCallback_(outputBuffer_.readableBytes());
+                }
+            }
+        }
+    }
+
+    size_t outputBacklog() const { return outputBuffer_.readableBytes(); }
+
+    /**
+     * 空闲超时：超过timeout没有收到数据就关闭连接
+     * 每次读不重新设置定时器，只记录时间；定时器到期时再检查，没超时就按剩余时间重新设置
+     */
+    void setIdleTimeout(std::chrono::milliseconds timeout) {
+        idleTimeout_ = timeout;
+        lastActive_ = std::chrono::steady_clock::now();
+        armIdleTimer(timeout);
+    }
     
-    void enableReading() { channel_->enableReading(); }
-    void disableReading() { channel_->disableReading(); }
+    /**
+     * 边沿触发，在enableReading()之前设置：EPOLLIN和EPOLLOUT一起注册一次，之后暂停读、等待可写都只改本地状态，
+     * 不再调用epoll_ctl；代价是读写都必须做到EAGAIN（或者短读、短写）为止
+     */
+    void setEdgeTriggered(bool on) { channel_.setEdgeTriggered(on); }
+
+    void enableReading() {
+        if (channel_.isEdgeTriggered()) {
+            // EPOLLRDHUP：对端关闭写方向之后，短读不代表读空了，见handleRead
+            channel_.setEvents(EPOLLIN | EPOLLPRI | EPOLLOUT | EPOLLRDHUP);
+            channel_.update();
+        } else {
+            channel_.enableReading();
+        }
+    }
+    void disableReading() { channel_.disableReading(); }
     
-    int fd() const { return channel_->getFd(); }
+    int fd() const { return channel_.getFd(); }
     
 private:
+    friend class Channel;
+
+    /**
+     * 一次事件里一直读到socket读空（短读或者EAGAIN），最多kMaxReadsPerEvent次
+     * 预算用完时水平触发下epoll还会报告；边沿触发不会，自己排到本轮事件之后接着读
+     */
     void handleRead() {
-        int savedErrno = 0;
-        ssize_t n = buffer_.readFromFd(channel_->getFd(), &savedErrno);
-        if (n > 0) {
-            if (readCallback_) {
-                std::string msg = buffer_.retrieveAsString(n);
-                readCallback_(msg);
-                // 回显
-                ::write(channel_->getFd(), msg.c_str(), msg.size());
+        // 边沿触发时暂停读、半关闭不会关掉EPOLLIN，事件还会来
+        if (closed_ || readPaused_ || closing_) {
+            return;
+        }
+        for (int i = 0; i < kMaxReadsPerEvent; i++) {
+            int savedErrno = 0;
+            size_t maxRead = buffer_.maxReadSize();
+            ssize_t n = buffer_.readFromFd(channel_.getFd(), &savedErrno);
+            if (n > 0) {
+                if (idleTimeout_.count() > 0) {
+                    lastActive_ = std::chrono::steady_clock::now();
+                }
+                if (readCallback_) {
+                    // 直接把输入缓冲区交出去、从那里回显，不拷贝出一个string
+                    std::string_view msg(buffer_.peek(), buffer_.readableBytes());
+                    readCallback_(msg);
+                    // 回显
+                    send(msg.data(), msg.size());
+                    buffer_.retrieve(msg.size());
+                }
+                if (closed_ || readPaused_) {
+                    return;
+                }
+                // 短读说明读空了，之后到达的数据会再通知；但数据和FIN一起到达时，FIN的那次通知已经用掉了，
+                // 读完数据还要接着读到EOF（EPOLLRDHUP一直留在revents里）
+                if (static_cast<size_t>(n) < maxRead && !(channel_.getRevents() & EPOLLRDHUP)) {
+                    return;
+                }
+            } else if (n == 0) {
+                if (outputBuffer_.readableBytes() > 0) {
+                    // 对端只是关闭了写方向，先把积压的数据发完再关闭
+                    closing_ = true;
+                    pauseReading();
+                    return;
+                }
+                handleClose();
+                return;
+            } else if (savedErrno != EINTR) {
+                if (savedErrno != EAGAIN && savedErrno != EWOULDBLOCK) {
+                    errno = savedErrno;
+                    handleError();
+                }
+                return;
             }
-        } else if (n == 0) {
-            handleClose();
-        } else {
-            errno = savedErrno;
-            handleError();
+        }
+        if (channel_.isEdgeTriggered()) {
+            scheduleRead();
         }
     }
     
+    // EPOLLOUT：把输出缓冲区一直发到发完或者写满（边沿触发必须如此），发完后关闭EPOLLOUT（水平触发，否则会一直就绪）
     void handleWrite() {
-        // 简单实现，无需写缓冲区
+        if (closed_ || outputBuffer_.readableBytes() == 0) {
+            return;
+        }
+        bool sent = false;
+        while (outputBuffer_.readableBytes() > 0) {
+            size_t len = outputBuffer_.readableBytes();
+            ssize_t n = ::send(channel_.getFd(), outputBuffer_.peek(), len, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    handleClose();
+                    return;
+                }
+                break;
+            }
+            outputBuffer_.retrieve(static_cast<size_t>(n));
+            sent = true;
+            // 短写说明发送缓冲区满了，内核在腾出空间时会再通知
+            if (static_cast<size_t>(n) < len) {
+                break;
+            }
+        }
+        if (!sent) {
+            return;
+        }
+        if (idleTimeout_.count() > 0) {
+            // 对端在读，也算活跃
+            lastActive_ = std::chrono::steady_clock::now();
+        }
+        if (outputBuffer_.readableBytes() == 0) {
+            stopWriting();
+            if (closing_) {
+                handleClose();
+                return;
+            }
+        }
+        if (readPaused_ && outputBuffer_.readableBytes() <= lowWatermark_) {
+            readPaused_ = false;
+            if (!closing_) {
+                resumeReading();
+            }
+            if (lowWatermarkCallback_) {
+                lowWatermarkCallback_(outputBuffer_.readableBytes());
+            }
+        }
+    }
+
+    // 水平触发时开关EPOLLIN/EPOLLOUT；边沿触发时两者一直注册着，只靠readPaused_/closing_和输出缓冲区的状态
+    void pauseReading() {
+        if (!channel_.isEdgeTriggered()) {
+            channel_.disableReading();
+        }
+    }
+
+    // 边沿触发时暂停期间到达的数据不会再有通知，主动读一次
+    void resumeReading() {
+        if (channel_.isEdgeTriggered()) {
+            scheduleRead();
+        } else {
+            channel_.enableReading();
+        }
+    }
+
+    void startWriting() {
+        if (!channel_.isWriting()) {
+            channel_.enableWriting();
+        }
+    }
+
+    void stopWriting() {
+        if (!channel_.isEdgeTriggered()) {
+            channel_.disableWriting();
+        }
+    }
+
+    void scheduleRead() {
+        if (readScheduled_) {
+            return;
+        }
+        readScheduled_ = true;
+        // NOTE: 捕获this是安全的：销毁Connection的任务只在关闭时排队，关闭之后handleRead不再排，所以它总在这个任务之后
+        loop_->queueInLoop([this] {
+            readScheduled_ = false;
+            handleRead();
+        });
     }
     
     void handleClose() {
-        channel_->disableAll();
+        if (closed_) {
+            return;
+        }
+        closed_ = true;
+        // 水平触发时在销毁之前会一直报告EOF/错误；边沿触发不会，本轮剩下的事件由closed_挡住
+        if (!channel_.isEdgeTriggered()) {
+            channel_.disableAll();
+        }
+        if (closeCallback_) {
+            closeCallback_(channel_.getFd());
+        }
+    }
+
+    void armIdleTimer(std::chrono::milliseconds delay) {
+        idleTimer_ = loop_->runAfter(delay, [this] { onIdleTimer(); });
+    }
+
+    void onIdleTimer() {
+        auto idle = std::chrono::steady_clock::now() - lastActive_;
+        if (idle >= idleTimeout_) {
+            idleTimer_ = {};
+            handleClose();
+        } else {
+            armIdleTimer(std::chrono::duration_cast<std::chrono::milliseconds>(idleTimeout_ - idle) + std::chrono::milliseconds(1));
+        }
     }
     
+    // 读出错或EPOLLERR：记下错误再关闭连接，和handleWrite出错时一样
+    // EPOLLERR时错误在SO_ERROR里；读出错时recv已经取走了它，用errno
     void handleError() {
-        // 错误处理
+        if (closed_) {
+            return;
+        }
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (::getsockopt(channel_.getFd(), SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err == 0) {
+            err = errno;
+        }
+        std::cerr << "Connection::handleError - fd " << channel_.getFd() << ": " << std::strerror(err) << std::endl;
+        handleClose();
     }
     
+    // Connection在slab中不会移动，Channel直接内嵌；它按cache line对齐，放在最前面不会在前面留下空洞
+    Channel channel_;
     EventLoop* loop_;
-    std::unique_ptr<Channel> channel_;
     ReadCallback readCallback_;
+    CloseCallback closeCallback_;
     Buffer buffer_;
+    // 还没发出去的数据
+    Buffer outputBuffer_;
+    size_t highWatermark_ = kDefaultHighWatermark;
+    size_t lowWatermark_ = kDefaultLowWatermark;
+    WatermarkCallback highWatermarkCallback_;
+    WatermarkCallback lowWatermarkCallback_;
+    // 积压超过高水位，暂停了读
+    bool readPaused_ = false;
+    // 对端关闭了写方向，发完积压的数据就关闭
+    bool closing_ = false;
+    bool closed_ = false;
+    // 边沿触发时已经排了一个继续读的任务
+    bool readScheduled_ = false;
+    std::chrono::milliseconds idleTimeout_{0};
+    std::chrono::steady_clock::time_point lastActive_;
+    TimerWheel::TimerId idleTimer_;
 }; 
\ No newline at end of file
@@ -45,9 +45,14 @@ void EPoller::poll(int timeoutMs, ChannelList* activeChannels) {
 
 void EPoller::updateChannel(Channel* channel) {
     struct epoll_event event;
-    event.events = channel->getEvents();
+    event.events = channel->epollEvents();
     event.data.ptr = channel;
     int fd = channel->getFd();
+    if (channel->isExclusive() && channel->getIndex() != -1) {
+        // NOTE: EPOLLEXCLUSIVE只能在ADD时指定，之后对这个fd的MOD都返回EINVAL，只能删掉重新加
+        ::epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, nullptr);
+        channel->setIndex(-1);
+    }
     if(channel->getIndex() == -1){
         int ret = ::epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
         if (ret < 0) {
@@ -64,7 +69,7 @@ void EPoller::updateChannel(Channel* channel) {
 
 void EPoller::removeChannel(Channel* channel) {
     struct epoll_event event;
-    event.events = channel->getEvents();
+    event.events = channel->epollEvents();
     event.data.ptr = channel;
     int fd = channel->getFd();
     int ret = ::epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, &event);
@@ -4,6 +4,7 @@
 #include <sys/eventfd.h>
 #include <unistd.h>
 #include <iostream>
+#include <utility>
 
 EventLoop::EventLoop() 
     : looping_(false), 
@@ -11,30 +12,50 @@ EventLoop::EventLoop()
       threadId(std::this_thread::get_id()),
       wakeupFd_(createEventfd()),
       poller_(std::make_unique<EPoller>(this)),
-      wakeupChannel_(std::make_unique<Channel>(this, wakeupFd_))
+      wakeupChannel_(std::make_unique<Channel>(this, wakeupFd_)),
+      timerFd_(createTimerfd()),
+      timerChannel_(std::make_unique<Channel>(this, timerFd_))
 {
     wakeupChannel_->setReadCallback([this] { handleRead(); });
     wakeupChannel_->enableReading();
+    timerChannel_->setReadCallback([this] { handleTimer(); });
+    timerChannel_->enableReading();
 }
 
 EventLoop::~EventLoop() {
+    // loop退出时还没执行的任务直接丢掉
+    PendingTask* task = remoteHead_.exchange(nullptr);
+    while (task) {
+        delete std::exchange(task, task->next);
+    }
+    task = std::exchange(localHead_, nullptr);
+    while (task) {
+        delete std::exchange(task, task->next);
+    }
     wakeupChannel_->disableAll();
     wakeupChannel_->remove();
     close(wakeupFd_);
+    timerChannel_->disableAll();
+    timerChannel_->remove();
+    close(timerFd_);
 }
 
 void EventLoop::loop() {
     looping_ = true;
-    quit_ = false;
+    // NOTE: 不在这里清除quit_，其他线程可能在loop()开始之前就调用了quit()
+    // loop()之前添加的定时器；否则要等第一个事件到来才会设置timerfd
+    armTimer();
 
     while (!quit_) {
         activeChannels_.clear();
-        poller_->poll(10000, &activeChannels_);
+        // 不需要轮询超时：定时器由timerfd唤醒，跨线程的任务由eventfd唤醒；上一轮执行任务时本线程又排了任务就不阻塞
+        poller_->poll(localHead_ ? 0 : -1, &activeChannels_);
         for (auto channel : activeChannels_) {
             channel->handleEvent();
         }
 
         doPendingFunctors();
+        armTimer();
     }
     
     looping_ = false;
@@ -48,27 +69,136 @@ void EventLoop::removeChannel(Channel* channel) {
     poller_->removeChannel(channel);
 }
 
-void EventLoop::runInLoop(const Functor& cb) {
+void EventLoop::queueBatchInLoop(std::vector<Functor> functors) {
+    if (functors.empty()) {
+        return;
+    }
+    PendingTask* first = nullptr;
+    PendingTask* last = nullptr;
+    bool local = isInLoopThread();
+    for (auto& functor : functors) {
+        PendingTask* task = new PendingFunctor<Functor>(std::move(functor));
+        if (!first) {
+            first = last = task;
+        } else if (local) {
+            last->next = task;
+            last = task;
+        } else {
+            task->next = last;
+            last = task;
+        }
+    }
+    if (local) {
+        appendLocal(first, last);
+    } else {
+        // 反向链接之后last是栈顶，first是栈底
+        pushRemote(last, first);
+    }
+}
+
+void EventLoop::post(PendingTask* task) {
     if (isInLoopThread()) {
-        cb();
+        appendLocal(task, task);
     } else {
-        {
-            std::lock_guard<std::mutex> lock(mutex_);
-            pendingFunctors_.push_back(cb);
-        }
+        pushRemote(task, task);
+    }
+}
+
+// loop线程在处理事件时排队的任务本轮就会执行；在执行任务时排的，下一轮poll不阻塞，都不需要唤醒
+void EventLoop::appendLocal(PendingTask* first, PendingTask* last) {
+    if (localTail_) {
+        localTail_->next = first;
+    } else {
+        localHead_ = first;
+    }
+    localTail_ = last;
+}
+
+void EventLoop::pushRemote(PendingTask* top, PendingTask* bottom) {
+    PendingTask* head = remoteHead_.load(std::memory_order_relaxed);
+    do {
+        bottom->next = head;
+    } while (!remoteHead_.compare_exchange_weak(head, top));
+    if (!wakeupPending_.exchange(true)) {
         wakeup();
     }
 }
 
 void EventLoop::doPendingFunctors() {
-    std::vector<Functor> functors;
-    {
-        std::lock_guard<std::mutex> lock(mutex_);
-        functors.swap(pendingFunctors_);
+    // 先清除唤醒标志再取栈：之后入队的一方一定会重新唤醒
+    if (wakeupPending_.load()) {
+        wakeupPending_.store(false);
+    }
+    if (remoteHead_.load()) {
+        // 栈是后进先出，反转成提交顺序，接到本地链表后面
+        PendingTask* node = remoteHead_.exchange(nullptr);
+        PendingTask* first = nullptr;
+        PendingTask* last = node;
+        while (node) {
+            PendingTask* next = node->next;
+            node->next = first;
+            first = node;
+            node = next;
+        }
+        appendLocal(first, last);
+    }
+    // 只执行现在排着的，执行期间新排的留到下一轮，不让一个不停重新排队的任务饿死I/O
+    PendingTask* task = std::exchange(localHead_, nullptr);
+    localTail_ = nullptr;
+    while (task) {
+        PendingTask* next = task->next;
+        task->run();
+        delete task;
+        task = next;
+    }
+}
+
+TimerWheel::TimerId EventLoop::runAfter(std::chrono::milliseconds delay, TimerWheel::Callback cb) {
+    timersChanged_ = true;
+    return timers_.runAfter(delay, std::move(cb));
+}
+
+TimerWheel::TimerId EventLoop::runEvery(std::chrono::milliseconds interval, TimerWheel::Callback cb) {
+    timersChanged_ = true;
+    return timers_.runEvery(interval, std::move(cb));
+}
+
+void EventLoop::handleTimer() {
+    uint64_t expirations = 0;
+    ssize_t n = read(timerFd_, &expirations, sizeof expirations);
+    if (n != sizeof expirations) {
+        std::cerr << "EventLoop::handleTimer() reads " << n << " bytes instead of 8" << std::endl;
+    }
+    timerArmed_ = false;
+    timers_.advance(TimerWheel::Clock::now());
+}
+
+// 只在最近的到期时间提前时才调用timerfd_settime，取消定时器不会推迟它，最多多醒一次
+void EventLoop::armTimer() {
+    if (timers_.size() == 0 || (timerArmed_ && !timersChanged_)) {
+        return;
+    }
+    timersChanged_ = false;
+    auto deadline = timers_.nextDueTime();
+    if (timerArmed_ && deadline >= timerDeadline_) {
+        return;
+    }
+    auto since = deadline.time_since_epoch();
+    auto seconds = std::chrono::duration_cast<std::chrono::seconds>(since);
+    itimerspec spec{};
+    spec.it_value.tv_sec = seconds.count();
+    spec.it_value.tv_nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(since - seconds).count();
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+        // 全0会解除timerfd
+        spec.it_value.tv_nsec = 1;
     }
-    for (const auto& functor : functors) {
-        functor();
+    // NOTE: steady_clock在Linux上就是CLOCK_MONOTONIC，所以可以直接用绝对时间
+    if (timerfd_settime(timerFd_, TFD_TIMER_ABSTIME, &spec, nullptr) < 0) {
+        perror("timerfd_settime");
+        return;
     }
+    timerArmed_ = true;
+    timerDeadline_ = deadline;
 }
 
 void EventLoop::wakeup() {
@@ -1,13 +1,17 @@
 #pragma once
+#include <atomic>
 #include <functional>
 #include <memory>
+#include <type_traits>
+#include <utility>
 #include <vector>
-#include <mutex>
 #include <thread>
 #include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 #include <iostream>
 #include <cstdlib>
+#include "TimerWheel.h"
 
 class Channel;
 class EPoller;
@@ -22,6 +26,15 @@ inline int createEventfd() {
     return fd;
 }
 
+inline int createTimerfd() {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        perror("timerfd_create");
+        exit(1);
+    }
+    return fd;
+}
+
 class EventLoop {
 public:
     using Functor = std::function<void()>;
@@ -36,21 +49,86 @@ public:
     void updateChannel(Channel* channel);
     void removeChannel(Channel* channel);
 
-    void runInLoop(const Functor& cb);
+    /**
+     * 跨线程的任务：任务和链接放在同一个节点里（一次分配），压入无锁的MPSC栈（Treiber栈）
+     * 连续的提交会合并唤醒：只有wakeupPending_从false变成true的那一次写eventfd，loop取走队列时再清除，
+     * 所以一个任务的开销是一次CAS加一次exchange
+     * loop线程自己排的任务放在普通的链表里，没有原子操作，也不需要唤醒
+     */
+
+    // 在loop线程中调用时直接执行，否则排队
+    template<typename F>
+    void runInLoop(F&& cb) {
+        if (isInLoopThread()) {
+            cb();
+        } else {
+            queueInLoop(std::forward<F>(cb));
+        }
+    }
+
+    // 总是排队，即使在loop线程中也不就地执行，在本轮事件处理完之后执行（例如在回调里销毁回调所属的对象）
+    template<typename F>
+    void queueInLoop(F&& cb) {
+        post(new PendingFunctor<std::decay_t<F>>(std::forward<F>(cb)));
+    }
+
+    // 一次排入一批任务：先链接好，一次CAS挂上，最多唤醒一次；按vector中的顺序执行
+    void queueBatchInLoop(std::vector<Functor> functors);
+
     void doPendingFunctors();
     void wakeup();
     void handleRead();
 
     bool isInLoopThread() const { return threadId == std::this_thread::get_id(); }
 
+    // 定时器，只能在loop线程中调用，回调也在loop线程中执行
+    TimerWheel::TimerId runAfter(std::chrono::milliseconds delay, TimerWheel::Callback cb);
+    TimerWheel::TimerId runEvery(std::chrono::milliseconds interval, TimerWheel::Callback cb);
+    bool cancelTimer(TimerWheel::TimerId id) { return timers_.cancel(id); }
+
 private:
+    struct PendingTask {
+        virtual ~PendingTask() = default;
+        virtual void run() = 0;
+        PendingTask* next = nullptr;
+    };
+
+    template<typename F>
+    struct PendingFunctor final : PendingTask {
+        template<typename G>
+        explicit PendingFunctor(G&& g) : f(std::forward<G>(g)) {}
+        void run() override { f(); }
+        F f;
+    };
+
+    void post(PendingTask* task);
+    // loop线程：first到last按执行顺序链接，接到本地链表后面
+    void appendLocal(PendingTask* first, PendingTask* last);
+    // 其他线程：top到bottom按提交顺序反向链接（栈顶是最后提交的），一次CAS压进栈，合并唤醒
+    void pushRemote(PendingTask* top, PendingTask* bottom);
+    void handleTimer();
+    void armTimer();
+
     ChannelList activeChannels_;
     bool looping_;
-    bool quit_;
+    // 其他线程通过quit()设置
+    std::atomic<bool> quit_;
     const std::thread::id threadId;
     int wakeupFd_;
     std::unique_ptr<EPoller> poller_;
     std::unique_ptr<Channel> wakeupChannel_;
-    std::mutex mutex_;
-    std::vector<Functor> pendingFunctors_;
+    // 其他线程排的任务（Treiber栈，后进先出），以及合并唤醒用的标志
+    std::atomic<PendingTask*> remoteHead_{nullptr};
+    std::atomic<bool> wakeupPending_{false};
+    // loop线程自己排的任务，先进先出；非空时下一轮poll不阻塞
+    PendingTask* localHead_ = nullptr;
+    PendingTask* localTail_ = nullptr;
+
+    // 时间轮由timerfd驱动，timerfd总是对准最近的到期时间
+    TimerWheel timers_;
+    int timerFd_;
+    std::unique_ptr<Channel> timerChannel_;
+    bool timersChanged_ = false;
+    bool timerArmed_ = false;
+    TimerWheel::Clock::time_point timerDeadline_;
 };
\ No newline at end of file
@@ -0,0 +1,50 @@
+#include "EventLoopThreadPool.h"
+#include "EventLoop.h"
+
+EventLoopThread::~EventLoopThread() {
+    stop();
+}
+
+EventLoop* EventLoopThread::start() {
+    thread_ = std::thread([this] { threadFunc(); });
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this] { return loop_ != nullptr; });
+    return loop_.get();
+}
+
+void EventLoopThread::stop() {
+    if (!thread_.joinable()) {
+        return;
+    }
+    loop_->quit();
+    thread_.join();
+}
+
+void EventLoopThread::threadFunc() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        loop_ = std::make_unique<EventLoop>();
+    }
+    cond_.notify_one();
+    loop_->loop();
+}
+
+EventLoopThreadPool::~EventLoopThreadPool() {
+    stop();
+}
+
+void EventLoopThreadPool::start() {
+    for (int i = 0; i < numThreads_; i++) {
+        threads_.push_back(std::make_unique<EventLoopThread>());
+        loops_.push_back(threads_.back()->start());
+    }
+    if (loops_.empty()) {
+        loops_.push_back(baseLoop_);
+    }
+}
+
+void EventLoopThreadPool::stop() {
+    for (auto& thread : threads_) {
+        thread->stop();
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "utils.h"
+
+class EventLoop;
+
+// 一个线程运行一个EventLoop；EventLoop在线程中创建（它记录创建它的线程），但由本对象持有，
+// 线程退出后仍然存在，挂在它上面的Connection可以在线程join之后再析构
+class EventLoopThread : noncopyable {
+public:
+    EventLoopThread() = default;
+    ~EventLoopThread();
+
+    // 启动线程，等它的EventLoop创建好之后返回
+    EventLoop* start();
+    // 让loop退出并join线程，EventLoop本身保留到析构
+    void stop();
+
+private:
+    void threadFunc();
+
+    std::unique_ptr<EventLoop> loop_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+};
+
+/**
+ * 多reactor：baseLoop（主reactor）只负责accept，另有numThreads个I/O线程各跑一个EventLoop，
+ * 新连接分配给其中一个loop，之后它的所有事件、定时器和销毁都在这个loop的线程里进行
+ * numThreads为0时所有连接都留在baseLoop上，和单线程的服务器一样
+ */
+class EventLoopThreadPool : noncopyable {
+public:
+    EventLoopThreadPool(EventLoop* baseLoop, int numThreads) : baseLoop_(baseLoop), numThreads_(numThreads) {}
+    ~EventLoopThreadPool();
+
+    // 只能在baseLoop的线程中调用一次
+    void start();
+    // 让所有I/O线程退出并join
+    void stop();
+
+    // 所有I/O loop，没有I/O线程时只有baseLoop；下标是稳定的，使用者可以按下标挂自己的状态（连接表、负载）
+    const std::vector<EventLoop*>& getAllLoops() const { return loops_; }
+
+private:
+    EventLoop* baseLoop_;
+    int numThreads_;
+    std::vector<std::unique_ptr<EventLoopThread>> threads_;
+    std::vector<EventLoop*> loops_;
+};
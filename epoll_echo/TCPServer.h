@@ -3,15 +3,24 @@
 #include "Socket.h"
 #include "Connection.h"
 #include "Acceptor.h"
+#include "Slab.h"
 #include "EventLoop.h"
+#include "EventLoopThreadPool.h"
 
+#include <atomic>
+#include <chrono>
+#include <cstddef>
 #include <functional>
-#include <map>
 #include <memory>
 #include <string>
+#include <string_view>
+#include <vector>
 
 class TCPServer : noncopyable {
 public:
+    // 新连接分给哪个I/O loop：轮询，或者当前连接数最少的
+    enum class Dispatch { RoundRobin, LeastLoaded };
+
     TCPServer(EventLoop* loop, const std::string& port) 
         : loop_(loop), 
           acceptor_(new Acceptor(loop, port)) 
@@ -23,27 +32,127 @@ public:
     }
 
     ~TCPServer() {
-        for (auto& conn : connections_) {
-            conn.second.reset();
+        // 先停下所有I/O线程，之后在这里析构连接不会和它们的loop并发
+        if (threadPool_) {
+            threadPool_->stop();
+        }
+        // 共享监听时acceptor在I/O loop上也有Channel，要在这些loop析构之前摘掉
+        acceptor_.reset();
+        for (auto& shard : shards_) {
+            shard->connections.clear();
         }
     }
 
+    // 空闲超过timeout的连接会被关闭，0表示不限制
+    void setIdleTimeout(std::chrono::milliseconds timeout) { idleTimeout_ = timeout; }
+
+    // 每个连接输出缓冲区的高低水位，见Connection::setWatermarks
+    void setWatermarks(size_t high, size_t low) {
+        highWatermark_ = high;
+        lowWatermark_ = low;
+    }
+
+    // listen()的backlog和TCP_DEFER_ACCEPT，见Acceptor；在start()之前设置
+    void setBacklog(int backlog) { acceptor_->setBacklog(backlog); }
+    void setDeferAccept(int seconds) { acceptor_->setDeferAccept(seconds); }
+
+    // I/O线程数，0（默认）表示所有连接都在accept的loop上处理；在start()之前设置
+    void setThreadNum(int numThreads) { numThreads_ = numThreads; }
+    void setDispatch(Dispatch dispatch) { dispatch_ = dispatch; }
+
+    // 连接用边沿触发注册，见Connection::setEdgeTriggered
+    void setEdgeTriggered(bool on) { edgeTriggered_ = on; }
+
+    // 每个I/O loop都直接等待listen socket（EPOLLEXCLUSIVE），自己accept自己的连接，没有主loop转交这一跳；
+    // 连接落在哪个loop由内核决定，setDispatch不再起作用。没有I/O线程时不起作用
+    void setSharedAccept(bool on) { sharedAccept_ = on; }
+
     void start() {
+        threadPool_ = std::make_unique<EventLoopThreadPool>(loop_, numThreads_);
+        threadPool_->start();
+        for (EventLoop* ioLoop : threadPool_->getAllLoops()) {
+            shards_.push_back(std::make_unique<IoShard>(ioLoop));
+        }
+        if (sharedAccept_ && numThreads_ > 0) {
+            for (auto& shard : shards_) {
+                IoShard* s = shard.get();
+                acceptor_->shareWith(s->loop, [this, s](int sockfd, const InetAddr& peerAddr) {
+                    s->connectionCount.fetch_add(1, std::memory_order_relaxed);
+                    setupConnection(s, sockfd, peerAddr);
+                });
+            }
+        }
         loop_->runInLoop([this]() { acceptor_->listen(); });
     }
 
 private:
+    // 一个I/O loop和挂在它上面的连接；connections只在该loop的线程中访问
+    struct IoShard {
+        explicit IoShard(EventLoop* loop) : loop(loop) {}
+        EventLoop* loop;
+        // 连接集中存放在slab中，地址不变（Channel的回调持有this）
+        Slab<Connection> connections;
+        // accept线程加，I/O线程减，只用来选loop
+        std::atomic<size_t> connectionCount{0};
+    };
+
+    IoShard* pickShard() {
+        if (dispatch_ == Dispatch::LeastLoaded) {
+            IoShard* least = shards_.front().get();
+            for (auto& shard : shards_) {
+                if (shard->connectionCount.load(std::memory_order_relaxed) < least->connectionCount.load(std::memory_order_relaxed)) {
+                    least = shard.get();
+                }
+            }
+            return least;
+        }
+        IoShard* shard = shards_[next_].get();
+        next_ = (next_ + 1) % shards_.size();
+        return shard;
+    }
+
+    // 在accept的loop中调用，连接在选中的I/O loop中创建，之后一直属于这个loop
     void newConnection(int sockfd, const InetAddr& peerAddr) {
-        auto conn = std::make_shared<Connection>(loop_, sockfd, peerAddr);
-        connections_[sockfd] = conn;
-        conn->setReadCallback([](const std::string& msg) {
+        IoShard* shard = pickShard();
+        shard->connectionCount.fetch_add(1, std::memory_order_relaxed);
+        shard->loop->runInLoop([this, shard, sockfd, peerAddr]() {
+            setupConnection(shard, sockfd, peerAddr);
+        });
+    }
+
+    void setupConnection(IoShard* shard, int sockfd, const InetAddr& peerAddr) {
+        auto [handle, conn] = shard->connections.emplace(shard->loop, sockfd, peerAddr);
+        conn->setEdgeTriggered(edgeTriggered_);
+        conn->setReadCallback([](std::string_view msg) {
             // 读回调在Connection中已处理回显逻辑
         });
+        conn->setCloseCallback([shard, handle = handle](int fd) {
+            // NOTE: 关闭发生在Connection自己的回调里，等本轮事件处理完再销毁它；
+            // handle带generation，重复的关闭不会误删同一槽位上的新连接
+            shard->loop->queueInLoop([shard, handle] {
+                if (shard->connections.erase(handle)) {
+                    shard->connectionCount.fetch_sub(1, std::memory_order_relaxed);
+                }
+            });
+        });
+        if (idleTimeout_.count() > 0) {
+            conn->setIdleTimeout(idleTimeout_);
+        }
+        conn->setWatermarks(highWatermark_, lowWatermark_);
         conn->enableReading();
     }
 
     EventLoop* loop_;
     std::unique_ptr<Acceptor> acceptor_;
-    using ConnectionMap = std::map<int, std::shared_ptr<Connection>>;
-    ConnectionMap connections_;
-};
\ No newline at end of file
+    std::chrono::milliseconds idleTimeout_{0};
+    size_t highWatermark_ = Connection::kDefaultHighWatermark;
+    size_t lowWatermark_ = Connection::kDefaultLowWatermark;
+    int numThreads_ = 0;
+    Dispatch dispatch_ = Dispatch::RoundRobin;
+    bool edgeTriggered_ = false;
+    bool sharedAccept_ = false;
+    size_t next_ = 0;
+    // 声明在shards_之前：shards_先析构，连接析构时它们的EventLoop还在
+    std::unique_ptr<EventLoopThreadPool> threadPool_;
+    std::vector<std::unique_ptr<IoShard>> shards_;
+};
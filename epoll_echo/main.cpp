@@ -1,12 +1,80 @@
 #include "EventLoop.h"
 #include "TCPServer.h"
 #include <iostream>
+#include <unistd.h>
+#include <cstdlib>
+
+int main(int argc, char* argv[]) {
+    // -T <ms>: 空闲超时，超过这个时间没有数据的连接会被关闭
+    // -W <bytes>: 输出缓冲区的高水位，积压超过它就暂停读该连接，降到四分之一时恢复
+    // -t <n>: I/O线程数，主线程只accept，连接分给n个I/O线程；0（默认）表示单线程
+    // -l: 新连接分给连接数最少的I/O线程，默认轮询
+    // -e: 连接用边沿触发（EPOLLET）
+    // -a: 每个I/O线程都直接accept（EPOLLEXCLUSIVE共享listen socket），不经过主线程
+    // -b <n>: listen的backlog，默认SOMAXCONN
+    // -D <s>: TCP_DEFER_ACCEPT，连接发来数据之后才accept，最多等s秒
+    int idleTimeoutMs = 0;
+    size_t highWatermark = Connection::kDefaultHighWatermark;
+    int threads = 0;
+    TCPServer::Dispatch dispatch = TCPServer::Dispatch::RoundRobin;
+    bool edgeTriggered = false;
+    bool sharedAccept = false;
+    int backlog = SOMAXCONN;
+    int deferAcceptSeconds = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "T:W:t:leab:D:")) != -1) {
+        switch (opt) {
+            case 'T':
+                idleTimeoutMs = std::atoi(optarg);
+                break;
+            case 'W':
+                highWatermark = static_cast<size_t>(std::atol(optarg));
+                break;
+            case 't':
+                threads = std::atoi(optarg);
+                break;
+            case 'l':
+                dispatch = TCPServer::Dispatch::LeastLoaded;
+                break;
+            case 'e':
+                edgeTriggered = true;
+                break;
+            case 'a':
+                sharedAccept = true;
+                break;
+            case 'b':
+                backlog = std::atoi(optarg);
+                break;
+            case 'D':
+                deferAcceptSeconds = std::atoi(optarg);
+                break;
+            default:
+                std::cerr << "Usage: " << argv[0] << " [-T idle_timeout_ms] [-W high_watermark_bytes] [-t io_threads] [-l] [-e] [-a] [-b backlog] [-D defer_accept_s]" << std::endl;
+                return 1;
+        }
+    }
 
-int main() {
     EventLoop loop;
     TCPServer server(&loop, "8080");
+    server.setIdleTimeout(std::chrono::milliseconds(idleTimeoutMs));
+    server.setWatermarks(highWatermark, highWatermark / 4);
+    server.setThreadNum(threads);
+    server.setDispatch(dispatch);
+    server.setEdgeTriggered(edgeTriggered);
+    server.setSharedAccept(sharedAccept);
+    server.setBacklog(backlog);
+    server.setDeferAccept(deferAcceptSeconds);
     
     std::cout << "Echo server is running on port 8080..." << std::endl;
+    if (idleTimeoutMs > 0) {
+        std::cout << "Idle timeout: " << idleTimeoutMs << " ms" << std::endl;
+    }
+    if (threads > 0) {
+        std::cout << "I/O threads: " << threads << (sharedAccept ? " (shared accept)" : "") << std::endl;
+    }
+    if (edgeTriggered) {
+        std::cout << "Edge-triggered connections" << std::endl;
+    }
     
     server.start();
     loop.loop();